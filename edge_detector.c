@@ -1,9 +1,28 @@
+#define _GNU_SOURCE // sched_setaffinity
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <sys/time.h>
 #include <pthread.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <sched.h>
+#include <signal.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 #define LAPLACIAN_THREADS 4 // change the number of threads as you run your concurrency experiment
 
@@ -11,23 +30,140 @@
 #define FILTER_WIDTH 3
 #define FILTER_HEIGHT 3
 
+/* Largest stencil radius a pipeline operator may use */
+#define MAX_FILTER_RADIUS 8
+
 #define RGB_COMPONENT_COLOR 255
 
-pthread_mutex_t time_mutex;
+pthread_mutex_t time_mutex = PTHREAD_MUTEX_INITIALIZER; // static initializer, so library builds (no main) can use it too
+
+/* Operators that can be chained with --pipeline. Point operators (luma, threshold) have radius 0,
+   stencil operators (blur, laplacian) read radius rows above and below the row they produce.
+ */
+enum op_kind
+{
+    OP_LUMA,
+    OP_BLUR,
+    OP_LAPLACIAN,
+    OP_THRESHOLD
+};
+
+#define MAX_PIPELINE_OPS 8
+
+struct pipeline_op
+{
+    enum op_kind kind;
+    int radius; // stencil radius, 0 for point operators
+    int arg;    // operator argument (threshold level), unused otherwise
+};
+
+struct pipeline
+{
+    int count;
+    struct pipeline_op ops[MAX_PIPELINE_OPS];
+};
 
 typedef struct
 {
     unsigned char r, g, b;
 } PPMPixel;
 
+/* A view of an image somewhere in memory: pixel (x, y) starts at base + y * stride + x * pixel size. The rows
+   don't have to be packed (stride can be more than width pixels) and the view doesn't have to own its memory, so a
+   window into a bigger image, a tile, a mapped file's payload after its header or a caller's padded buffer can all
+   be filtered and written where they are, without copying them into a w * h PPMPixel array first.
+ */
+enum pixel_format
+{
+    PIXEL_RGB24,  // PPMPixel
+    PIXEL_GRAY8,
+    PIXEL_BAYER8, // raw sensor samples behind a colour filter array (see --bayer), filtered as RGB
+    PIXEL_BAYER16 // the same with 16-bit little-endian samples
+};
+
+struct image_view
+{
+    unsigned char *base;          // first byte of row 0
+    unsigned long int width, height;
+    size_t stride;                // bytes from the start of one row to the next
+    enum pixel_format format;
+};
+
+static inline int pixel_size(enum pixel_format format)
+{
+    switch (format)
+    {
+    case PIXEL_GRAY8:
+    case PIXEL_BAYER8:
+        return 1;
+    case PIXEL_BAYER16:
+        return 2;
+    default:
+        return 3;
+    }
+}
+
+static inline int is_bayer(enum pixel_format format)
+{
+    return format == PIXEL_BAYER8 || format == PIXEL_BAYER16;
+}
+
+/* Return: the format the filter writes for a src view of format (Bayer data comes out demosaiced to RGB). */
+static inline enum pixel_format filtered_format(enum pixel_format format)
+{
+    return is_bayer(format) ? PIXEL_RGB24 : format;
+}
+
+static inline unsigned char *view_row(const struct image_view *v, long y)
+{
+    return v->base + y * v->stride;
+}
+
+/* Return: a view of a packed w x h RGB image, the layout read_image and apply_filters use. */
+struct image_view packed_view(PPMPixel *pixels, unsigned long int w, unsigned long int h)
+{
+    struct image_view v = {(unsigned char *)pixels, w, h, w * sizeof(PPMPixel), PIXEL_RGB24};
+    return v;
+}
+
+/* Set *out to the w x h window of v whose top left corner is (x, y). A Bayer window has to start and end on whole
+   2x2 cells, so it keeps the colour filter pattern. Return: 0, or -1 if it doesn't fit inside v.
+ */
+int crop_view(const struct image_view *v, unsigned long int x, unsigned long int y, unsigned long int w, unsigned long int h,
+              struct image_view *out)
+{
+    if (w == 0 || h == 0 || x > v->width || y > v->height || w > v->width - x || h > v->height - y)
+        return -1;
+    if (is_bayer(v->format) && (x % 2 || y % 2 || w % 2 || h % 2))
+        return -1;
+    unsigned char *base = view_row(v, y) + x * pixel_size(v->format);
+    *out = *v; // out may be v
+    out->base = base;
+    out->width = w;
+    out->height = h;
+    return 0;
+}
+
+/* Gets every result row as soon as it is computed, while it is still in cache (see --hough). */
+struct row_sink
+{
+    void (*row)(void *context, long y, const unsigned char *pixels, long width, int step);
+    void *context;
+};
+
+struct hough_votes;
+
 struct parameter
 {
-    PPMPixel *image;         // original image pixel data
-    PPMPixel *result;        // filtered image pixel data
-    unsigned long int w;     // width of image
-    unsigned long int h;     // height of image
+    struct image_view src;   // original image pixel data
+    struct image_view dst;   // filtered image pixel data, same size and format as src (RGB if src is Bayer)
     unsigned long int start; // starting point of work
     unsigned long int size;  // equal share of work (almost equal if odd)
+    const struct pipeline *pipeline; // operator chain to run instead of the plain laplacian (NULL if none)
+    const struct kernel *kernel;     // convolution kernel (NULL for the laplacian)
+    const struct float_kernel *float_kernel; // float kernel to use instead of kernel (NULL if none)
+    struct hough_votes *votes;       // accumulator the edge pixels vote into (NULL if none)
+    struct filter_job *job;          // job this tile belongs to
 };
 
 struct file_name_args
@@ -41,305 +177,6031 @@ to compute the edge detection of all input images .
 */
 double total_elapsed_time = 0;
 
-/*This is the thread function. It will compute the new values for the region of image specified in params (start to start+size) using convolution.
-    For each pixel in the input image, the filter is conceptually placed on top ofthe image with its origin lying on that pixel.
-    The  values  of  each  input  image  pixel  under  the  mask  are  multiplied  by the corresponding filter values.
-    Truncate values smaller than zero to zero and larger than 255 to 255.
-    The results are summed together to yield a single output value that is placed in the output image at the location of the pixel being processed on the input.
+/* Operator chain given with --pipeline. NULL runs the plain laplacian filter. */
+struct pipeline filter_pipeline_spec;
+const struct pipeline *filter_pipeline = NULL;
 
+/* Integer convolution kernels (--kernel). The kernel is size x size (odd, up to MAX_KERNEL_SIZE) and is applied to
+   every channel separately, with the same wrap-around edges and 0..255 clamping as the original laplacian.
+   prepare_kernel looks at the range of the coefficients to decide how the SIMD path may accumulate:
+   if 255 * sum(|c|) fits in 16 bits and every coefficient fits in a signed byte, pairs of taps are multiplied and
+   added with pmaddubsw into 16-bit sums; otherwise pairs are widened to words and combined with pmaddwd into 32-bit sums.
  */
-void *compute_laplacian_threadfn(void *params)
+#define MAX_KERNEL_SIZE 7
+#define MAX_KERNEL_TAPS (MAX_KERNEL_SIZE * MAX_KERNEL_SIZE)
+
+struct kernel
 {
-    struct parameter *param = (struct parameter *)params;
+    int size;                    // kernel is size x size
+    int coef[MAX_KERNEL_TAPS];   // row-major coefficients
+    // filled in by prepare_kernel
+    int taps;                    // number of non-zero coefficients
+    int tap_row[MAX_KERNEL_TAPS], tap_col[MAX_KERNEL_TAPS], tap_coef[MAX_KERNEL_TAPS];
+    int accumulate_16;           // 1 if the 16-bit (pmaddubsw) path is exact for this kernel
+};
 
-    int laplacian[FILTER_WIDTH][FILTER_HEIGHT] = {
-        {-1, -1, -1},
-        {-1, 8, -1},
-        {-1, -1, -1}};
+struct kernel laplacian_kernel = {FILTER_WIDTH, {-1, -1, -1, -1, 8, -1, -1, -1, -1}, 0, {0}, {0}, {0}, 0};
+struct kernel filter_kernel_spec;
+const struct kernel *filter_kernel = &laplacian_kernel; // set by --kernel
+int simd_enabled = 1;                                  // cleared by --no-simd
+static pthread_once_t laplacian_kernel_once = PTHREAD_ONCE_INIT;
 
-    int red, green, blue;
-    unsigned long image_width = param->w;
-    unsigned long image_height = param->h;
-    unsigned long start_row = param->start;
-    unsigned long num_rows = param->size;
-    unsigned long end_row = start_row + num_rows;
+static long wrap_index(long i, long n)
+{
+    i %= n;
+    return i < 0 ? i + n : i;
+}
 
-    for (unsigned long y = start_row; y < end_row; y++)
+void prepare_kernel(struct kernel *k)
+{
+    long magnitude = 0;
+    int fits_byte = 1;
+    k->taps = 0;
+    for (int i = 0; i < k->size * k->size; i++)
     {
-        for (unsigned long x = 0; x < image_width; x++)
-        {
-            red = 0;
-            green = 0;
-            blue = 0;
-
-            // iterate over filter dimensions
-            for (int fy = 0; fy < FILTER_HEIGHT; fy++)
-            {
-                for (int fx = 0; fx < FILTER_WIDTH; fx++)
-                {
-                    // calculate coordinates for the input image
-                    int x_coordinate = (x - FILTER_WIDTH / 2 + fx + image_width) % image_width;
-                    int y_coordinate = (y - FILTER_HEIGHT / 2 + fy + image_height) % image_height;
-
-                    // index for the current pixel in the image
-                    unsigned long pixelIndex = y_coordinate * image_width + x_coordinate;
-
-                    // perform convolution by applying the filter
-                    red += param->image[pixelIndex].r * laplacian[fy][fx];
-                    green += param->image[pixelIndex].g * laplacian[fy][fx];
-                    blue += param->image[pixelIndex].b * laplacian[fy][fx];
-                }
-            }
-
-            // clamp values to the range [0, 255]
-            red = red < 0 ? 0 : (red > 255 ? 255 : red);
-            green = green < 0 ? 0 : (green > 255 ? 255 : green);
-            blue = blue < 0 ? 0 : (blue > 255 ? 255 : blue);
-
-            // store the computed values in the result image
-            unsigned long result_index = y * image_width + x;
-            param->result[result_index].r = (unsigned char)red;
-            param->result[result_index].g = (unsigned char)green;
-            param->result[result_index].b = (unsigned char)blue;
-        }
+        if (k->coef[i] == 0)
+            continue;
+        k->tap_row[k->taps] = i / k->size;
+        k->tap_col[k->taps] = i % k->size;
+        k->tap_coef[k->taps] = k->coef[i];
+        k->taps++;
+        magnitude += k->coef[i] < 0 ? -k->coef[i] : k->coef[i];
+        if (k->coef[i] < -128 || k->coef[i] > 127)
+            fits_byte = 0;
     }
+    k->accumulate_16 = fits_byte && 255 * magnitude <= 32767;
+}
 
-    return NULL;
+static void prepare_laplacian_kernel(void)
+{
+    prepare_kernel(&laplacian_kernel);
 }
 
-/* Apply the Laplacian filter to an image using threads.
- Each thread shall do an equal share of the work, i.e. work=height/number of threads. If the size is not even, the last thread shall take the rest of the work.
- Compute the elapsed time and store it in *elapsedTime (Read about gettimeofday).
- Return: result (filtered image)
+/* Parse a kernel given as comma separated coefficients in row-major order (9, 25 or 49 of them),
+   or "@file" holding them separated by commas or whitespace.
+   Return: 0 on success, -1 (after printing why) if the kernel is not valid.
  */
-PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, double *elapsed_time)
+int parse_kernel(const char *spec, struct kernel *k)
 {
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
+    char buffer[1024];
 
-    PPMPixel *result = (PPMPixel *)malloc(w * h * sizeof(PPMPixel));
-    if (!result)
+    if (spec[0] == '@')
     {
-        fprintf(stderr, "Error: Unable to allocate memory for result image\n");
-        return NULL;
+        FILE *fp = fopen(spec + 1, "r");
+        if (!fp)
+        {
+            fprintf(stderr, "Error: Unable to open kernel file %s\n", spec + 1);
+            return -1;
+        }
+        size_t n = fread(buffer, 1, sizeof(buffer) - 1, fp);
+        fclose(fp);
+        buffer[n] = '\0';
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "%s", spec);
     }
 
-    pthread_t threads[LAPLACIAN_THREADS];
-    struct parameter params[LAPLACIAN_THREADS];
-    pthread_mutex_lock(&time_mutex);
-
-    for (int i = 0; i < LAPLACIAN_THREADS; i++)
+    int count = 0;
+    for (char *tok = strtok(buffer, ", \t\r\n"); tok; tok = strtok(NULL, ", \t\r\n"))
     {
-        params[i].image = image;
-        params[i].result = result;
-        params[i].w = w;
-        params[i].h = h;
-        params[i].start = i * (h / LAPLACIAN_THREADS);
-        params[i].size = (i == LAPLACIAN_THREADS - 1) ? h - params[i].start : (h + LAPLACIAN_THREADS - 1) / LAPLACIAN_THREADS;
-        if (pthread_create(&threads[i], NULL, compute_laplacian_threadfn, &params[i]) != 0)
+        char *end;
+        long value = strtol(tok, &end, 10);
+        if (*end != '\0' || value < -32767 || value > 32767)
         {
-            fprintf(stderr, "Error: Unable to create filter thread %d\n", i);
-            free(result); // ensure memory is freed before exit
-            return NULL;
+            fprintf(stderr, "Error: Kernel coefficient '%s' is not an integer between -32767 and 32767\n", tok);
+            return -1;
         }
+        if (count == MAX_KERNEL_TAPS)
+        {
+            fprintf(stderr, "Error: Kernel is larger than %dx%d\n", MAX_KERNEL_SIZE, MAX_KERNEL_SIZE);
+            return -1;
+        }
+        k->coef[count++] = (int)value;
     }
 
-    for (int i = 0; i < LAPLACIAN_THREADS; i++)
+    for (k->size = 1; k->size * k->size < count; k->size += 2)
+        ;
+    if (k->size * k->size != count || k->size > MAX_KERNEL_SIZE)
     {
-        pthread_join(threads[i], NULL);
+        fprintf(stderr, "Error: Kernel needs 1, 9, 25 or 49 coefficients, got %d\n", count);
+        return -1;
     }
-
-    gettimeofday(&end, NULL);
-    *elapsed_time = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
-    pthread_mutex_unlock(&time_mutex);
-
-    return result;
+    prepare_kernel(k);
+    return 0;
 }
 
-/*Create a new P6 file to save the filtered image in. Write the header block
- e.g. P6
-      Width Height
-      Max color value
- then write the image data.
- The name of the new file shall be "filename" (the second argument).
+/* Scalar reference for one output row: rows[i] points at padded input row i of the kernel window, n output bytes,
+   step bytes between horizontally adjacent pixels of the same channel.
  */
-void write_image(PPMPixel *image, char *filename, unsigned long int width, unsigned long int height)
+static void convolve_row_scalar(const struct kernel *k, const unsigned char *const *rows, unsigned char *out, size_t n, int step)
 {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp)
+    for (size_t i = 0; i < n; i++)
     {
-        fprintf(stderr, "Error: Unable to open file %s for writing\n", filename);
-        exit(1);
+        int sum = 0;
+        for (int t = 0; t < k->taps; t++)
+            sum += rows[k->tap_row[t]][i + k->tap_col[t] * step] * k->tap_coef[t];
+        out[i] = (unsigned char)(sum < 0 ? 0 : (sum > 255 ? 255 : sum));
     }
-    pthread_mutex_lock(&time_mutex);
-    // write the PPM header
-    fprintf(fp, "P6\n%lu %lu\n%d\n", width, height, RGB_COMPONENT_COLOR);
-    pthread_mutex_unlock(&time_mutex);
+}
 
-    // write the pixel data
-    size_t pixel_count = width * height;
-    if (fwrite(image, sizeof(PPMPixel), pixel_count, fp) != pixel_count)
+#ifdef HAVE_X86_SIMD
+/* 16 outputs at a time. Two taps are interleaved byte by byte and pmaddubsw multiplies both by their (signed byte)
+   coefficients and adds them, so every instruction does two taps for 16 pixels. Only exact when accumulate_16 is set.
+ */
+__attribute__((target("ssse3"))) static void convolve_row_ssse3(const struct kernel *k, const unsigned char *const *rows,
+                                                                unsigned char *out, size_t n, int step)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
     {
-        fprintf(stderr, "Error: Failed to write pixel data to file %s\n", filename);
-        fclose(fp);
-        exit(1);
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        for (int t = 0; t < k->taps; t += 2)
+        {
+            int second = t + 1 < k->taps ? t + 1 : t; // odd tap count: pair the last tap with itself at weight 0
+            int c0 = k->tap_coef[t], c1 = t + 1 < k->taps ? k->tap_coef[t + 1] : 0;
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[k->tap_row[t]] + i + k->tap_col[t] * step));
+            __m128i b = _mm_loadu_si128((const __m128i *)(rows[k->tap_row[second]] + i + k->tap_col[second] * step));
+            __m128i weights = _mm_set1_epi16((short)(((c1 & 0xff) << 8) | (c0 & 0xff)));
+            lo = _mm_add_epi16(lo, _mm_maddubs_epi16(_mm_unpacklo_epi8(a, b), weights));
+            hi = _mm_add_epi16(hi, _mm_maddubs_epi16(_mm_unpackhi_epi8(a, b), weights));
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+    }
+    if (i < n)
+    {
+        const unsigned char *tail[MAX_KERNEL_SIZE];
+        for (int r = 0; r < k->size; r++)
+            tail[r] = rows[r] + i;
+        convolve_row_scalar(k, tail, out + i, n - i, step);
     }
-    fclose(fp);
 }
 
-/* Open the filename image for reading, and parse it.
-    Example of a ppm header:    //http://netpbm.sourceforge.net/doc/ppm.html
-    P6                  -- image format
-    # comment           -- comment lines begin with
-    ## another comment  -- any number of comment lines
-    200 300             -- image width & height
-    255                 -- max color value
-
- Check if the image format is P6. If not, print invalid format error message.
- If there are comments in the file, skip them. You may assume that comments exist only in the header block.
- Read the image size information and store them in width and height.
- Check the rgb component, if not 255, display error message.
- Return: pointer to PPMPixel that has the pixel data of the input image (filename).The pixel data is stored in scanline order from left to right (up to bottom) in 3-byte chunks (r g b values for each pixel) encoded as binary numbers.
+/* 16 outputs at a time with 32-bit sums, for kernels whose range doesn't fit 16 bits. Two taps are widened to words
+   and interleaved so pmaddwd computes a*c0 + b*c1 for four pixels per instruction. The final packs saturate to 0..255.
  */
-PPMPixel *read_image(const char *filename, unsigned long int *width, unsigned long int *height)
+__attribute__((target("sse2"))) static void convolve_row_sse2_wide(const struct kernel *k, const unsigned char *const *rows,
+                                                                   unsigned char *out, size_t n, int step)
 {
-    // open the file in binary mode
-    FILE *fp = fopen(filename, "rb");
-    if (!fp)
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
     {
-        fprintf(stderr, "Error: Unable to open file %s\n", filename);
-        exit(1);
+        __m128i acc0 = zero, acc1 = zero, acc2 = zero, acc3 = zero;
+        for (int t = 0; t < k->taps; t += 2)
+        {
+            int second = t + 1 < k->taps ? t + 1 : t;
+            int c0 = k->tap_coef[t], c1 = t + 1 < k->taps ? k->tap_coef[t + 1] : 0;
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[k->tap_row[t]] + i + k->tap_col[t] * step));
+            __m128i b = _mm_loadu_si128((const __m128i *)(rows[k->tap_row[second]] + i + k->tap_col[second] * step));
+            __m128i weights = _mm_set1_epi32((int)(((unsigned)c1 << 16) | (c0 & 0xffff)));
+            __m128i a_lo = _mm_unpacklo_epi8(a, zero), a_hi = _mm_unpackhi_epi8(a, zero);
+            __m128i b_lo = _mm_unpacklo_epi8(b, zero), b_hi = _mm_unpackhi_epi8(b, zero);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a_lo, b_lo), weights));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a_lo, b_lo), weights));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(a_hi, b_hi), weights));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(a_hi, b_hi), weights));
+        }
+        __m128i words_lo = _mm_packs_epi32(acc0, acc1), words_hi = _mm_packs_epi32(acc2, acc3);
+        _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(words_lo, words_hi));
     }
-
-    // make sure right format
-    char magic[3];
-    if (!fgets(magic, sizeof(magic), fp) || strncmp(magic, "P6", 2) != 0)
+    if (i < n)
     {
-        fprintf(stderr, "Error: Invalid format in file %s\n", filename);
-        fclose(fp);
-        exit(1);
+        const unsigned char *tail[MAX_KERNEL_SIZE];
+        for (int r = 0; r < k->size; r++)
+            tail[r] = rows[r] + i;
+        convolve_row_scalar(k, tail, out + i, n - i, step);
     }
+}
+#endif
 
-    // skip comments and read width, height, and max color value
-    unsigned long int local_width, local_height;
-    int max_color_value;
+typedef void (*convolve_row_fn)(const struct kernel *, const unsigned char *const *, unsigned char *, size_t, int);
 
-    while (1)
+/* Pick the fastest row function this CPU can run exactly for kernel k. */
+static convolve_row_fn select_convolve_row(const struct kernel *k)
+{
+#ifdef HAVE_X86_SIMD
+    if (simd_enabled)
     {
-        char line[128];
-        if (!fgets(line, sizeof(line), fp))
-        {
-            fprintf(stderr, "Error: Unexpected end of file in header of %s\n", filename);
-            fclose(fp);
-            exit(1);
-        }
-        if (line[0] == '#')
-            continue; // comment
-        if (sscanf(line, "%lu %lu", &local_width, &local_height) == 2)
-            break; // width and height
+        if (k->accumulate_16 && __builtin_cpu_supports("ssse3"))
+            return convolve_row_ssse3;
+        if (__builtin_cpu_supports("sse2"))
+            return convolve_row_sse2_wide;
     }
+#else
+    (void)k;
+#endif
+    return convolve_row_scalar;
+}
 
-    // read max color value
-    while (1)
+/* Bayer input (--bayer). Each pixel of a Bayer view holds one sample, red, green or blue depending on where it is in
+   the repeating 2x2 cell of the colour filter; the pattern names the cell's top row then bottom row (RGGB, BGGR, GRBG,
+   GBRG). The filter never sees the raw samples: whenever a kernel, the float path or the first pipeline stage pulls in
+   an input row, demosaic_row makes it RGB right there from the three raw rows around it, so a full-resolution RGB
+   copy of the image is never built. Wide samples are scaled down to 8 bits by their significant bits.
+ */
+static struct
+{
+    int enabled;
+    int red_x, red_y;               // position of the red sample in the 2x2 cell
+    int bits;                       // significant bits of a sample (8 for PIXEL_BAYER8)
+    unsigned long int width, height;
+} bayer_input = {0, 0, 0, 8, 0, 0};
+
+static inline int bayer_sample(const unsigned char *row, long x, int wide)
+{
+    if (!wide)
+        return row[x];
+    int value = (row[2 * x] | row[2 * x + 1] << 8) >> (bayer_input.bits - 8);
+    return value > 255 ? 255 : value;
+}
+
+/* Bilinear demosaic of row y of the Bayer view src into w RGB pixels: a site's own colour is its sample, the other two
+   are the mean of the nearest samples of that colour (the 4 edge neighbours or the 4 corners at red and blue sites,
+   the 2 horizontal or 2 vertical neighbours at green sites). Neighbours wrap around the edges like the filter does.
+ */
+static void demosaic_row(const struct image_view *src, long y, PPMPixel *out)
+{
+    long w = src->width;
+    int wide = src->format == PIXEL_BAYER16;
+    y = wrap_index(y, src->height);
+    const unsigned char *above = view_row(src, wrap_index(y - 1, src->height)), *row = view_row(src, y),
+                        *below = view_row(src, wrap_index(y + 1, src->height));
+    int red_row = ((y ^ bayer_input.red_y) & 1) == 0;
+    for (long x = 0; x < w; x++)
     {
-        char line[128];
-        if (!fgets(line, sizeof(line), fp))
+        long left = x ? x - 1 : w - 1, right = x + 1 < w ? x + 1 : 0;
+        int own = bayer_sample(row, x, wide);
+        int north = bayer_sample(above, x, wide), south = bayer_sample(below, x, wide);
+        int west = bayer_sample(row, left, wide), east = bayer_sample(row, right, wide);
+        int red_column = ((x ^ bayer_input.red_x) & 1) == 0;
+        if (red_row == red_column)
         {
-            fprintf(stderr, "Error: Unexpected end of file in header of %s\n", filename);
-            fclose(fp);
-            exit(1);
+            // red site (or blue site): green on the edges, blue (or red) on the corners
+            int edges = (north + south + west + east + 2) >> 2;
+            int corners = (bayer_sample(above, left, wide) + bayer_sample(above, right, wide) + bayer_sample(below, left, wide) +
+                           bayer_sample(below, right, wide) + 2) >> 2;
+            out[x].r = (unsigned char)(red_row ? own : corners);
+            out[x].g = (unsigned char)edges;
+            out[x].b = (unsigned char)(red_row ? corners : own);
+        }
+        else
+        {
+            // green site: on a red row red is left and right and blue above and below, the other way round on a blue row
+            int across = (west + east + 1) >> 1, updown = (north + south + 1) >> 1;
+            out[x].r = (unsigned char)(red_row ? across : updown);
+            out[x].g = (unsigned char)own;
+            out[x].b = (unsigned char)(red_row ? updown : across);
         }
-        if (line[0] == '#')
-            continue;
-        if (sscanf(line, "%d", &max_color_value) == 1)
-            break;
     }
+}
 
-    // make sure it's right
-    if (max_color_value != RGB_COMPONENT_COLOR)
+/* Copy row y of src into padded, with radius pixels of wrap-around on each side. Bayer rows are demosaiced into it. */
+static void pad_row(const struct image_view *src, long y, int radius, unsigned char *padded)
+{
+    long w = src->width;
+    int step = pixel_size(filtered_format(src->format));
+    const unsigned char *row = view_row(src, wrap_index(y, src->height));
+    if (is_bayer(src->format))
     {
-        fprintf(stderr, "Error: Invalid max color value in file %s\n", filename);
-        fclose(fp);
-        exit(1);
+        demosaic_row(src, y, (PPMPixel *)(padded + radius * step));
+        row = padded + radius * step;
     }
+    for (long x = -radius; x < 0; x++)
+        memcpy(padded + (x + radius) * step, row + wrap_index(x, w) * step, step);
+    if (row != padded + radius * step)
+        memcpy(padded + radius * step, row, w * step);
+    for (long x = w; x < w + radius; x++)
+        memcpy(padded + (x + radius) * step, row + wrap_index(x, w) * step, step);
+}
 
-    // allocate mem
-    size_t pixel_count = local_width * local_height;
-    PPMPixel *image = (PPMPixel *)malloc(pixel_count * sizeof(PPMPixel));
-    if (!image)
-    {
-        fprintf(stderr, "Error: Unable to allocate memory for image data\n");
-        fclose(fp);
-        exit(1);
-    }
+/* Convolve rows y0 to y1 (exclusive) of src with kernel k, every channel on its own, into dst, which holds just
+   those rows (row y goes to row y - y0 of dst). Each finished row is also handed to sink, if not NULL.
+   Input rows are padded once into a ring of k->size rows, so the row function never has to wrap indices.
+   Return: 0, or -1 if the ring buffer couldn't be allocated.
+ */
+int convolve_rows(const struct kernel *k, const struct image_view *src, const struct image_view *dst, long y0, long y1,
+                  const struct row_sink *sink)
+{
+    long w = src->width;
+    int step = pixel_size(dst->format);
+    int radius = k->size / 2;
+    size_t padded_bytes = (size_t)(w + 2 * radius) * step;
+    unsigned char *ring = (unsigned char *)malloc(k->size * padded_bytes);
+    if (!ring)
+        return -1;
+
+    convolve_row_fn convolve_row = select_convolve_row(k);
+    for (long y = y0 - radius; y < y0 + radius; y++)
+        pad_row(src, y, radius, ring + wrap_index(y, k->size) * padded_bytes);
 
-    // read pixel data
-    if (fread(image, sizeof(PPMPixel), pixel_count, fp) != pixel_count)
+    for (long y = y0; y < y1; y++)
     {
-        fprintf(stderr, "Error: Unexpected end of file while reading pixel data in %s\n", filename);
-        free(image);
-        fclose(fp);
-        exit(1);
+        const unsigned char *rows[MAX_KERNEL_SIZE];
+        pad_row(src, y + radius, radius, ring + wrap_index(y + radius, k->size) * padded_bytes);
+        for (int r = 0; r < k->size; r++)
+            rows[r] = ring + wrap_index(y - radius + r, k->size) * padded_bytes;
+        convolve_row(k, rows, view_row(dst, y - y0), w * step, step);
+        if (sink)
+            sink->row(sink->context, y, view_row(dst, y - y0), w, step);
     }
 
-    fclose(fp);
-
-    *width = local_width;
-    *height = local_height;
+    free(ring);
+    return 0;
+}
 
-    return image;
+/* Copy row y of each of count w x h images into padded, interleaving them pixel by pixel (pixel x of image i goes to
+   (x + radius) * count + i), with radius pixels of wrap-around on each side of every image.
+ */
+static void pad_batch_row(PPMPixel *const *images, int count, long w, long h, long y, int radius, unsigned char *padded)
+{
+    PPMPixel *out = (PPMPixel *)padded;
+    long row = wrap_index(y, h) * w;
+    for (long x = -radius; x < w + radius; x++)
+    {
+        long column = row + wrap_index(x, w);
+        for (int i = 0; i < count; i++)
+            out[(x + radius) * count + i] = images[i][column];
+    }
 }
 
-/* The thread function that manages an image file.
- Read an image file that is passed as an argument at runtime.
- Apply the Laplacian filter.
- Update the value of total_elapsed_time.
- Save the result image in a file called laplaciani.ppm, where i is the image file order in the passed arguments.
- Example: the result image of the file passed third during the input shall be called "laplacian3.ppm".
-*/
-void *manage_image_file(void *args)
+/* Convolve count same-size w x h images with kernel k in one pass (--batch-small). For icon-sized images a row is only
+   a few vectors long and most of the work is edges and per-row overhead; interleaved, the row function sees one row of
+   w * count pixels with a step of count pixels between neighbours, so every vector works on the same pixel of several
+   images and each call does count images' rows at once. The result rows are scattered back to results.
+   Return: 0, or -1 if the buffers couldn't be allocated.
+ */
+int convolve_batch(const struct kernel *k, PPMPixel *const *images, PPMPixel *const *results, int count, long w, long h)
 {
-    struct file_name_args *file_args = (struct file_name_args *)args;
+    int step = count * sizeof(PPMPixel);
+    int radius = k->size / 2;
+    size_t padded_bytes = (size_t)(w + 2 * radius) * step;
+    unsigned char *ring = (unsigned char *)malloc(k->size * padded_bytes + w * step);
+    if (!ring)
+        return -1;
+    PPMPixel *out = (PPMPixel *)(ring + k->size * padded_bytes);
 
-    unsigned long int width, height;
-    PPMPixel *image = read_image(file_args->input_file_name, &width, &height);
+    convolve_row_fn convolve_row = select_convolve_row(k);
+    for (long y = -radius; y < radius; y++)
+        pad_batch_row(images, count, w, h, y, radius, ring + wrap_index(y, k->size) * padded_bytes);
 
-    double elapsed_time;
-    PPMPixel *result = apply_filters(image, width, height, &elapsed_time);
+    for (long y = 0; y < h; y++)
+    {
+        const unsigned char *rows[MAX_KERNEL_SIZE];
+        pad_batch_row(images, count, w, h, y + radius, radius, ring + wrap_index(y + radius, k->size) * padded_bytes);
+        for (int r = 0; r < k->size; r++)
+            rows[r] = ring + wrap_index(y - radius + r, k->size) * padded_bytes;
+        convolve_row(k, rows, (unsigned char *)out, w * step, step);
+        for (int i = 0; i < count; i++)
+            for (long x = 0; x < w; x++)
+                results[i][y * w + x] = out[x * count + i];
+    }
 
-    write_image(result, file_args->output_file_name, width, height);
+    free(ring);
+    return 0;
+}
+
+/* Floating-point kernels (--float-kernel), for filters that need fractional weights: a Laplacian of Gaussian or a
+   Gaussian derivative with any sigma, or explicit coefficients. Input rows are converted to float once as they are
+   padded, then every tap is one fused multiply-add. The result is clamped to 0..255 and rounded to nearest (ties to
+   even); the scalar reference uses fmaf in the same tap order, so the AVX2 and AVX-512 paths give identical output.
+ */
+enum float_isa
+{
+    FLOAT_ISA_AUTO,
+    FLOAT_ISA_SCALAR,
+    FLOAT_ISA_AVX2,
+    FLOAT_ISA_AVX512
+};
+
+struct float_kernel
+{
+    int size;                     // kernel is size x size
+    float coef[MAX_KERNEL_TAPS];  // row-major coefficients
+    // filled in by prepare_float_kernel
+    int taps;
+    int tap_row[MAX_KERNEL_TAPS], tap_col[MAX_KERNEL_TAPS];
+    float tap_coef[MAX_KERNEL_TAPS];
+};
+
+struct float_kernel filter_float_kernel_spec;
+const struct float_kernel *filter_float_kernel = NULL; // set by --float-kernel
+enum float_isa float_isa = FLOAT_ISA_AUTO;             // widest ISA the float path may use
+
+void prepare_float_kernel(struct float_kernel *k)
+{
+    k->taps = 0;
+    for (int i = 0; i < k->size * k->size; i++)
+    {
+        if (k->coef[i] == 0.0f)
+            continue;
+        k->tap_row[k->taps] = i / k->size;
+        k->tap_col[k->taps] = i % k->size;
+        k->tap_coef[k->taps] = k->coef[i];
+        k->taps++;
+    }
+}
+
+/* Parse a float kernel: "log:SIGMA" (Laplacian of Gaussian, scaled so its positive weights add up to 8 like the
+   laplacian's), "gauss-dx:SIGMA" / "gauss-dy:SIGMA" (Gaussian derivative, scaled to give the slope of a ramp), or
+   comma separated coefficients (9, 25 or 49). Generated kernels span 3 sigma, at most MAX_KERNEL_SIZE wide.
+   Return: 0 on success, -1 (after printing why) if the kernel is not valid.
+ */
+int parse_float_kernel(const char *spec, struct float_kernel *k)
+{
+    double sigma = 0;
+    int kind = 0; // 1 = log, 2 = gauss-dx, 3 = gauss-dy
+    if (strncmp(spec, "log:", 4) == 0)
+        kind = 1, sigma = atof(spec + 4);
+    else if (strncmp(spec, "gauss-dx:", 9) == 0)
+        kind = 2, sigma = atof(spec + 9);
+    else if (strncmp(spec, "gauss-dy:", 9) == 0)
+        kind = 3, sigma = atof(spec + 9);
+
+    if (kind)
+    {
+        if (!(sigma > 0) || !isfinite(sigma))
+        {
+            fprintf(stderr, "Error: Kernel sigma must be positive\n");
+            return -1;
+        }
+        int radius = 3 * sigma > MAX_KERNEL_SIZE / 2 ? MAX_KERNEL_SIZE / 2 : (int)ceil(3 * sigma);
+        k->size = 2 * radius + 1;
+
+        double values[MAX_KERNEL_TAPS], mean = 0, scale = 0;
+        for (int y = -radius; y <= radius; y++)
+        {
+            for (int x = -radius; x <= radius; x++)
+            {
+                double r2 = (x * x + y * y) / (2 * sigma * sigma);
+                double g = exp(-r2);
+                double v = kind == 1 ? (1 - r2) * g : (kind == 2 ? x : y) * g;
+                values[(y + radius) * k->size + x + radius] = v;
+                mean += v / (k->size * k->size);
+            }
+        }
+        for (int i = 0; i < k->size * k->size; i++)
+        {
+            if (kind == 1)
+                values[i] -= mean; // a flat region has to give 0 even with the kernel cut off at 3 sigma
+            if (kind == 1 && values[i] > 0)
+                scale += values[i] / 8;
+            else if (kind != 1)
+                scale += values[i] * ((kind == 2 ? i % k->size : i / k->size) - radius);
+        }
+        if (!isfinite(scale) || scale == 0)
+        {
+            // e.g. a Gaussian derivative whose off-centre weights all underflow
+            fprintf(stderr, "Error: Kernel %s comes out all zero, try another sigma\n", spec);
+            return -1;
+        }
+        for (int i = 0; i < k->size * k->size; i++)
+            k->coef[i] = (float)(values[i] / scale);
+    }
+    else
+    {
+        char buffer[2048];
+        snprintf(buffer, sizeof(buffer), "%s", spec);
+        int count = 0;
+        for (char *tok = strtok(buffer, ", \t\r\n"); tok; tok = strtok(NULL, ", \t\r\n"))
+        {
+            char *end;
+            float value = strtof(tok, &end);
+            if (*end != '\0' || !isfinite(value) || count == MAX_KERNEL_TAPS)
+            {
+                fprintf(stderr, "Error: Invalid float kernel coefficient '%s'\n", tok);
+                return -1;
+            }
+            k->coef[count++] = value;
+        }
+        for (k->size = 1; k->size * k->size < count; k->size += 2)
+            ;
+        if (k->size * k->size != count || k->size > MAX_KERNEL_SIZE)
+        {
+            fprintf(stderr, "Error: Kernel needs 1, 9, 25 or 49 coefficients, got %d\n", count);
+            return -1;
+        }
+    }
+    prepare_float_kernel(k);
+    return 0;
+}
+
+static void convolve_row_float_scalar(const struct float_kernel *k, const float *const *rows, unsigned char *out, size_t n, int step)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        float sum = 0.0f;
+        for (int t = 0; t < k->taps; t++)
+            sum = fmaf(rows[k->tap_row[t]][i + k->tap_col[t] * step], k->tap_coef[t], sum);
+        sum = fminf(fmaxf(sum, 0.0f), 255.0f);
+        out[i] = (unsigned char)nearbyintf(sum);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2,fma"))) static void convolve_row_float_avx2(const struct float_kernel *k, const float *const *rows,
+                                                                        unsigned char *out, size_t n, int step)
+{
+    const __m256 zero = _mm256_setzero_ps(), max = _mm256_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 sum = zero;
+        for (int t = 0; t < k->taps; t++)
+            sum = _mm256_fmadd_ps(_mm256_loadu_ps(rows[k->tap_row[t]] + i + k->tap_col[t] * step), _mm256_set1_ps(k->tap_coef[t]), sum);
+        __m256i values = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(sum, zero), max));
+        __m128i words = _mm_packs_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(words, words));
+    }
+    if (i < n)
+    {
+        const float *tail[MAX_KERNEL_SIZE];
+        for (int r = 0; r < k->size; r++)
+            tail[r] = rows[r] + i;
+        convolve_row_float_scalar(k, tail, out + i, n - i, step);
+    }
+}
+
+__attribute__((target("avx512f"))) static void convolve_row_float_avx512(const struct float_kernel *k, const float *const *rows,
+                                                                         unsigned char *out, size_t n, int step)
+{
+    const __m512 zero = _mm512_setzero_ps(), max = _mm512_set1_ps(255.0f);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m512 sum = zero;
+        for (int t = 0; t < k->taps; t++)
+            sum = _mm512_fmadd_ps(_mm512_loadu_ps(rows[k->tap_row[t]] + i + k->tap_col[t] * step), _mm512_set1_ps(k->tap_coef[t]), sum);
+        __m512i values = _mm512_cvtps_epi32(_mm512_min_ps(_mm512_max_ps(sum, zero), max));
+        _mm_storeu_si128((__m128i *)(out + i), _mm512_cvtepi32_epi8(values));
+    }
+    if (i < n)
+    {
+        const float *tail[MAX_KERNEL_SIZE];
+        for (int r = 0; r < k->size; r++)
+            tail[r] = rows[r] + i;
+        convolve_row_float_scalar(k, tail, out + i, n - i, step);
+    }
+}
+#endif
+
+typedef void (*convolve_row_float_fn)(const struct float_kernel *, const float *const *, unsigned char *, size_t, int);
+
+/* Pick the widest float row function allowed by float_isa (and --no-simd) that this CPU supports. */
+static convolve_row_float_fn select_convolve_row_float(void)
+{
+#ifdef HAVE_X86_SIMD
+    if (simd_enabled && float_isa != FLOAT_ISA_SCALAR)
+    {
+        if ((float_isa == FLOAT_ISA_AUTO || float_isa == FLOAT_ISA_AVX512) && __builtin_cpu_supports("avx512f"))
+            return convolve_row_float_avx512;
+        if (float_isa != FLOAT_ISA_AVX512 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return convolve_row_float_avx2;
+    }
+#endif
+    return convolve_row_float_scalar;
+}
+
+/* Like pad_row, converting the bytes to floats on the way. A Bayer row is demosaiced into scratch (w pixels) first. */
+static void pad_row_float(const struct image_view *src, long y, int radius, float *padded, PPMPixel *scratch)
+{
+    long w = src->width;
+    int step = pixel_size(filtered_format(src->format));
+    const unsigned char *row = view_row(src, wrap_index(y, src->height));
+    if (is_bayer(src->format))
+    {
+        demosaic_row(src, y, scratch);
+        row = (const unsigned char *)scratch;
+    }
+    for (long x = -radius; x < w + radius; x++)
+    {
+        const unsigned char *pixel = row + wrap_index(x, w) * step;
+        for (int c = 0; c < step; c++)
+            padded[(x + radius) * step + c] = pixel[c];
+    }
+}
+
+/* The float counterpart of convolve_rows. Return: 0, or -1 if the ring buffer couldn't be allocated. */
+int convolve_rows_float(const struct float_kernel *k, const struct image_view *src, const struct image_view *dst, long y0,
+                        long y1, const struct row_sink *sink)
+{
+    long w = src->width;
+    int step = pixel_size(dst->format);
+    int radius = k->size / 2;
+    size_t padded_floats = (size_t)(w + 2 * radius) * step;
+    float *ring = (float *)malloc(k->size * padded_floats * sizeof(float));
+    PPMPixel *scratch = is_bayer(src->format) ? (PPMPixel *)malloc(w * sizeof(PPMPixel)) : NULL;
+    if (!ring || (is_bayer(src->format) && !scratch))
+    {
+        free(ring);
+        free(scratch);
+        return -1;
+    }
+
+    convolve_row_float_fn convolve_row = select_convolve_row_float();
+    for (long y = y0 - radius; y < y0 + radius; y++)
+        pad_row_float(src, y, radius, ring + wrap_index(y, k->size) * padded_floats, scratch);
+
+    for (long y = y0; y < y1; y++)
+    {
+        const float *rows[MAX_KERNEL_SIZE];
+        pad_row_float(src, y + radius, radius, ring + wrap_index(y + radius, k->size) * padded_floats, scratch);
+        for (int r = 0; r < k->size; r++)
+            rows[r] = ring + wrap_index(y - radius + r, k->size) * padded_floats;
+        convolve_row(k, rows, view_row(dst, y - y0), w * step, step);
+        if (sink)
+            sink->row(sink->context, y, view_row(dst, y - y0), w, step);
+    }
+
+    free(ring);
+    free(scratch);
+    return 0;
+}
+
+int edge_threshold = 64; // laplacian response that counts as an edge (--triage, --components, --hough)
+
+/* Hough line accumulation fused into the filter (--hough). A line is x cos(theta) + y sin(theta) = rho, with theta
+   in HOUGH_THETAS steps of one degree and rho in one pixel steps. Every result pixel with a channel reaching
+   edge_threshold votes for the HOUGH_THETAS lines through it as soon as its row is computed, so the edge image is
+   never read back. A tile borrows a partial accumulator from the image's idle list (or makes one if every partial is
+   in use) and returns it when it is done, so there are only as many partials as tiles ever ran at once. hough_merge
+   adds them up once the whole image is done, and hough_top_lines picks the strongest local maxima.
+ */
+#define HOUGH_THETAS 180
+#define HOUGH_PEAK_RADIUS 3 // a peak must beat every cell within this many rho/theta steps
+
+struct hough_partial
+{
+    struct hough_partial *next;
+    unsigned int counts[];    // laid out like hough_votes.counts
+};
+
+struct hough_votes
+{
+    int rho_max;              // rho runs from -rho_max to rho_max
+    unsigned int *counts;     // HOUGH_THETAS rows of 2 * rho_max + 1 rho bins, complete after hough_merge
+    struct hough_partial *idle; // partials no tile is voting into right now
+    pthread_mutex_t lock;     // protects idle
+};
+
+struct hough_line
+{
+    int rho;
+    int theta;                // degrees
+    unsigned int votes;
+};
+
+struct hough_tile
+{
+    struct hough_votes *votes;
+    struct hough_partial *partial; // accumulator this tile votes into, borrowed from votes
+    int threshold;
+};
+
+int hough_top_k = 0; // lines --hough reports per image, 0 when off
+
+static float hough_cos[HOUGH_THETAS], hough_sin[HOUGH_THETAS];
+static pthread_once_t hough_once = PTHREAD_ONCE_INIT;
+
+static void prepare_hough_tables(void)
+{
+    for (int t = 0; t < HOUGH_THETAS; t++)
+    {
+        hough_cos[t] = (float)cos(t * M_PI / HOUGH_THETAS);
+        hough_sin[t] = (float)sin(t * M_PI / HOUGH_THETAS);
+    }
+}
+
+static size_t hough_bins(const struct hough_votes *votes)
+{
+    return (size_t)HOUGH_THETAS * (2 * votes->rho_max + 1);
+}
+
+/* Set up an empty accumulator for a width x height image. Return: 0, or -1 if out of memory. */
+int hough_init(struct hough_votes *votes, unsigned long int width, unsigned long int height)
+{
+    pthread_once(&hough_once, prepare_hough_tables);
+    votes->rho_max = (int)ceil(sqrt((double)width * width + (double)height * height));
+    votes->counts = (unsigned int *)calloc(hough_bins(votes), sizeof(unsigned int));
+    votes->idle = NULL;
+    pthread_mutex_init(&votes->lock, NULL);
+    return votes->counts ? 0 : -1;
+}
+
+/* Add the partial accumulators up into votes->counts and free them. Call once the image is done, before
+   hough_top_lines.
+ */
+void hough_merge(struct hough_votes *votes)
+{
+    size_t bins = hough_bins(votes);
+    while (votes->idle)
+    {
+        struct hough_partial *partial = votes->idle;
+        votes->idle = partial->next;
+        for (size_t i = 0; i < bins; i++)
+            votes->counts[i] += partial->counts[i];
+        free(partial);
+    }
+}
+
+void hough_free(struct hough_votes *votes)
+{
+    while (votes->idle)
+    {
+        struct hough_partial *partial = votes->idle;
+        votes->idle = partial->next;
+        free(partial);
+    }
+    free(votes->counts);
+    pthread_mutex_destroy(&votes->lock);
+}
+
+/* row_sink of a tile: every edge pixel of row y votes for each line through it. */
+static void hough_vote_row(void *context, long y, const unsigned char *pixels, long width, int step)
+{
+    struct hough_tile *tile = (struct hough_tile *)context;
+    int rho_bins = 2 * tile->votes->rho_max + 1;
+    for (long x = 0; x < width; x++)
+    {
+        const unsigned char *p = pixels + x * step;
+        int edge = 0;
+        for (int c = 0; c < step; c++)
+            edge |= p[c] >= tile->threshold;
+        if (!edge)
+            continue;
+        unsigned int *counts = tile->partial->counts + tile->votes->rho_max;
+        for (int t = 0; t < HOUGH_THETAS; t++, counts += rho_bins)
+            counts[lrintf(x * hough_cos[t] + y * hough_sin[t])]++;
+    }
+}
+
+/* Start a tile's votes in an idle partial accumulator, or a new one. Return: 0, or -1 if out of memory. */
+static int hough_tile_begin(struct hough_tile *tile, struct hough_votes *votes)
+{
+    tile->votes = votes;
+    tile->threshold = edge_threshold;
+    pthread_mutex_lock(&votes->lock);
+    tile->partial = votes->idle;
+    if (tile->partial)
+        votes->idle = tile->partial->next;
+    pthread_mutex_unlock(&votes->lock);
+    if (!tile->partial)
+        tile->partial = (struct hough_partial *)calloc(1, sizeof(struct hough_partial) + hough_bins(votes) * sizeof(unsigned int));
+    return tile->partial ? 0 : -1;
+}
+
+/* Give a finished tile's partial accumulator back, votes and all, for the next tile of the image. */
+static void hough_tile_end(struct hough_tile *tile)
+{
+    pthread_mutex_lock(&tile->votes->lock);
+    tile->partial->next = tile->votes->idle;
+    tile->votes->idle = tile->partial;
+    pthread_mutex_unlock(&tile->votes->lock);
+}
+
+static int compare_hough_lines(const void *a, const void *b)
+{
+    const struct hough_line *x = (const struct hough_line *)a, *y = (const struct hough_line *)b;
+    return (x->votes < y->votes) - (x->votes > y->votes);
+}
+
+/* Find the (up to) k strongest lines: cells that beat every neighbour within HOUGH_PEAK_RADIUS (ties go to the
+ first in scan order). Return: how many were stored in lines, which must have room for k.
+ */
+int hough_top_lines(const struct hough_votes *votes, struct hough_line *lines, int k)
+{
+    int rho_bins = 2 * votes->rho_max + 1, found = 0;
+    for (int t = 0; t < HOUGH_THETAS; t++)
+    {
+        for (int r = 0; r < rho_bins; r++)
+        {
+            unsigned int v = votes->counts[t * rho_bins + r];
+            if (v == 0 || (found == k && v <= lines[k - 1].votes))
+                continue;
+            int peak = 1;
+            for (int dt = -HOUGH_PEAK_RADIUS; dt <= HOUGH_PEAK_RADIUS && peak; dt++)
+            {
+                for (int dr = -HOUGH_PEAK_RADIUS; dr <= HOUGH_PEAK_RADIUS && peak; dr++)
+                {
+                    int nt = t + dt, nr = r + dr;
+                    if ((dt == 0 && dr == 0) || nt < 0 || nt >= HOUGH_THETAS || nr < 0 || nr >= rho_bins)
+                        continue;
+                    unsigned int n = votes->counts[nt * rho_bins + nr];
+                    peak = (dt < 0 || (dt == 0 && dr < 0)) ? v > n : v >= n;
+                }
+            }
+            if (!peak)
+                continue;
+            // insert into the sorted top k
+            if (found < k)
+                found++;
+            lines[found - 1] = (struct hough_line){r - votes->rho_max, t, v};
+            qsort(lines, found, sizeof(struct hough_line), compare_hough_lines);
+        }
+    }
+    return found;
+}
+
+/* Print the hough_top_k strongest lines of an image, all in one go so images finishing together don't mix.
+   Return: 0, or -1 if out of memory.
+ */
+int print_hough_lines(const char *file_name, const struct hough_votes *votes)
+{
+    static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct hough_line *lines = (struct hough_line *)malloc(hough_top_k * sizeof(struct hough_line));
+    if (!lines)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for Hough lines\n");
+        return -1;
+    }
+    int found = hough_top_lines(votes, lines, hough_top_k);
+    pthread_mutex_lock(&print_mutex);
+    printf("%s: %d strongest lines (x cos theta + y sin theta = rho)\n", file_name, found);
+    for (int i = 0; i < found; i++)
+        printf("  rho %6d  theta %3d deg  votes %u\n", lines[i].rho, lines[i].theta, lines[i].votes);
+    pthread_mutex_unlock(&print_mutex);
+    free(lines);
+    return 0;
+}
+
+/*This is the thread function. It will compute the new values for the region of image specified in params (start to start+size) using convolution.
+    For each pixel in the input image, the filter is conceptually placed on top ofthe image with its origin lying on that pixel.
+    The  values  of  each  input  image  pixel  under  the  mask  are  multiplied  by the corresponding filter values.
+    Truncate values smaller than zero to zero and larger than 255 to 255.
+    The results are summed together to yield a single output value that is placed in the output image at the location of the pixel being processed on the input.
+    The filter is param->float_kernel if set (see convolve_rows_float), else param->kernel (the laplacian if NULL).
+    Unless --no-simd was given the rows go through convolve_rows, otherwise (or if its buffers can't be allocated) through the plain loop below.
+
+ */
+static void tile_failed(struct parameter *param); // with the worker pool below
+
+void *compute_laplacian_threadfn(void *params)
+{
+    struct parameter *param = (struct parameter *)params;
+    const struct kernel *kernel = param->kernel ? param->kernel : &laplacian_kernel;
+
+    int red, green, blue;
+    unsigned long image_width = param->src.width;
+    unsigned long image_height = param->src.height;
+    unsigned long start_row = param->start;
+    unsigned long num_rows = param->size;
+    unsigned long end_row = start_row + num_rows;
+
+    // with --hough the rows vote into this tile's accumulator as they come out
+    struct hough_tile hough;
+    struct row_sink hough_sink = {hough_vote_row, &hough}, *sink = NULL;
+    if (param->votes)
+    {
+        if (hough_tile_begin(&hough, param->votes) != 0)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for Hough votes\n");
+            tile_failed(param);
+            return NULL;
+        }
+        sink = &hough_sink;
+    }
+
+    struct image_view band; // our rows of the result
+    crop_view(&param->dst, 0, start_row, image_width, num_rows, &band);
+    int done = 0, failed = 0;
+    if (param->float_kernel)
+    {
+        // no falling back to the integer kernel if this fails: that would be a different filter
+        done = convolve_rows_float(param->float_kernel, &param->src, &band, start_row, end_row, sink) == 0;
+        failed = !done;
+    }
+
+    // vectorized path (falls back to a scalar row function where there is no SIMD); the only one for gray and Bayer views
+    if (!done && !failed && (simd_enabled || param->src.format != PIXEL_RGB24))
+    {
+        done = convolve_rows(kernel, &param->src, &band, start_row, end_row, sink) == 0;
+        failed = !done && param->src.format != PIXEL_RGB24; // the loop below reads RGB pixels
+    }
+
+    int filter_size = kernel->size;
+    for (unsigned long y = start_row; !done && !failed && y < end_row; y++)
+    {
+        for (unsigned long x = 0; x < image_width; x++)
+        {
+            red = 0;
+            green = 0;
+            blue = 0;
+
+            // iterate over filter dimensions
+            for (int fy = 0; fy < filter_size; fy++)
+            {
+                for (int fx = 0; fx < filter_size; fx++)
+                {
+                    // calculate coordinates for the input image
+                    int x_coordinate = wrap_index((long)x - filter_size / 2 + fx, image_width);
+                    int y_coordinate = wrap_index((long)y - filter_size / 2 + fy, image_height);
+
+                    // the current pixel in the image
+                    const PPMPixel *pixel = (const PPMPixel *)view_row(&param->src, y_coordinate) + x_coordinate;
+
+                    // perform convolution by applying the filter
+                    int weight = kernel->coef[fy * filter_size + fx];
+                    red += pixel->r * weight;
+                    green += pixel->g * weight;
+                    blue += pixel->b * weight;
+                }
+            }
+
+            // clamp values to the range [0, 255]
+            red = red < 0 ? 0 : (red > 255 ? 255 : red);
+            green = green < 0 ? 0 : (green > 255 ? 255 : green);
+            blue = blue < 0 ? 0 : (blue > 255 ? 255 : blue);
+
+            // store the computed values in the result image
+            PPMPixel *result = (PPMPixel *)view_row(&param->dst, y) + x;
+            result->r = (unsigned char)red;
+            result->g = (unsigned char)green;
+            result->b = (unsigned char)blue;
+        }
+        if (sink)
+            sink->row(sink->context, y, view_row(&param->dst, y), image_width, sizeof(PPMPixel));
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for filter rows\n");
+        tile_failed(param);
+    }
+    if (sink)
+        hough_tile_end(&hough);
+    return NULL;
+}
+
+/* Per-thread state of a fused pipeline pass. Stage k keeps the rows the next stage still needs in a ring
+   buffer of 2 * radius(k+1) + 1 rows, so no intermediate image is ever allocated. The last stage writes
+   straight into the result image.
+ */
+struct pipeline_state
+{
+    const struct pipeline *pipeline;
+    const struct image_view *src;
+    const struct image_view *dst;
+    const struct row_sink *sink;       // gets the rows of the last stage (NULL if none)
+    long w, h;
+    PPMPixel *source_ring;             // demosaiced input rows, for Bayer input (NULL otherwise)
+    long *source_rows;                 // which input row each slot of source_ring holds
+    int source_capacity;
+    PPMPixel *rings[MAX_PIPELINE_OPS]; // ring buffer holding the output rows of each stage
+    int capacity[MAX_PIPELINE_OPS];    // number of rows in each ring
+    long next[MAX_PIPELINE_OPS];       // next row each stage will produce
+    int *column_sums;                  // scratch for the blur operator (3 sums per column)
+};
+
+/* Return row y of the output of stage k. Stage -1 is the input image, which wraps around like the plain filter;
+   Bayer input rows are demosaiced into a ring the first time the first stage asks for them.
+ */
+static const PPMPixel *pipeline_row(struct pipeline_state *st, int k, long y)
+{
+    if (k < 0 && st->source_ring)
+    {
+        int slot = (int)wrap_index(y, st->source_capacity);
+        PPMPixel *row = st->source_ring + slot * st->w;
+        if (st->source_rows[slot] != y)
+        {
+            demosaic_row(st->src, y, row);
+            st->source_rows[slot] = y;
+        }
+        return row;
+    }
+    if (k < 0)
+        return (const PPMPixel *)view_row(st->src, wrap_index(y, st->h));
+    return st->rings[k] + wrap_index(y, st->capacity[k]) * st->w;
+}
+
+static void run_operator(const struct pipeline_op *op, const PPMPixel **in, PPMPixel *out, long w, int *column_sums)
+{
+    switch (op->kind)
+    {
+    case OP_LUMA:
+        for (long x = 0; x < w; x++)
+        {
+            const PPMPixel *p = &in[0][x];
+            unsigned char y = (unsigned char)((77 * p->r + 150 * p->g + 29 * p->b + 128) >> 8);
+            out[x].r = out[x].g = out[x].b = y;
+        }
+        break;
+
+    case OP_THRESHOLD:
+        for (long x = 0; x < w; x++)
+        {
+            out[x].r = in[0][x].r >= op->arg ? 255 : 0;
+            out[x].g = in[0][x].g >= op->arg ? 255 : 0;
+            out[x].b = in[0][x].b >= op->arg ? 255 : 0;
+        }
+        break;
+
+    case OP_LAPLACIAN:
+        for (long x = 0; x < w; x++)
+        {
+            int red = 0, green = 0, blue = 0;
+            for (int fy = 0; fy < 3; fy++)
+            {
+                for (int fx = -1; fx <= 1; fx++)
+                {
+                    const PPMPixel *p = &in[fy][wrap_index(x + fx, w)];
+                    int weight = (fy == 1 && fx == 0) ? 8 : -1;
+                    red += p->r * weight;
+                    green += p->g * weight;
+                    blue += p->b * weight;
+                }
+            }
+            out[x].r = (unsigned char)(red < 0 ? 0 : (red > 255 ? 255 : red));
+            out[x].g = (unsigned char)(green < 0 ? 0 : (green > 255 ? 255 : green));
+            out[x].b = (unsigned char)(blue < 0 ? 0 : (blue > 255 ? 255 : blue));
+        }
+        break;
+
+    case OP_BLUR:
+    {
+        // box blur: sum each column over the window, then slide a window across the column sums
+        int r = op->radius;
+        int n = (2 * r + 1) * (2 * r + 1);
+        for (long x = 0; x < w; x++)
+        {
+            int sr = 0, sg = 0, sb = 0;
+            for (int fy = 0; fy <= 2 * r; fy++)
+            {
+                sr += in[fy][x].r;
+                sg += in[fy][x].g;
+                sb += in[fy][x].b;
+            }
+            column_sums[3 * x] = sr;
+            column_sums[3 * x + 1] = sg;
+            column_sums[3 * x + 2] = sb;
+        }
+        int wr = 0, wg = 0, wb = 0;
+        for (long fx = -r; fx <= r; fx++)
+        {
+            long c = wrap_index(fx, w);
+            wr += column_sums[3 * c];
+            wg += column_sums[3 * c + 1];
+            wb += column_sums[3 * c + 2];
+        }
+        for (long x = 0; x < w; x++)
+        {
+            out[x].r = (unsigned char)((wr + n / 2) / n);
+            out[x].g = (unsigned char)((wg + n / 2) / n);
+            out[x].b = (unsigned char)((wb + n / 2) / n);
+            long leaving = wrap_index(x - r, w), entering = wrap_index(x + r + 1, w);
+            wr += column_sums[3 * entering] - column_sums[3 * leaving];
+            wg += column_sums[3 * entering + 1] - column_sums[3 * leaving + 1];
+            wb += column_sums[3 * entering + 2] - column_sums[3 * leaving + 2];
+        }
+        break;
+    }
+    }
+}
+
+/* Make stage k produce every row up to and including y, pulling the rows it needs from stage k-1 first. */
+static void pipeline_advance(struct pipeline_state *st, int k, long y)
+{
+    const struct pipeline_op *op = &st->pipeline->ops[k];
+    const PPMPixel *in[2 * MAX_FILTER_RADIUS + 1];
+
+    while (st->next[k] <= y)
+    {
+        long row = st->next[k];
+        if (k > 0)
+            pipeline_advance(st, k - 1, row + op->radius);
+        for (int i = -op->radius; i <= op->radius; i++)
+            in[i + op->radius] = pipeline_row(st, k - 1, row + i);
+
+        PPMPixel *out = (k == st->pipeline->count - 1) ? (PPMPixel *)view_row(st->dst, row)
+                                                        : st->rings[k] + wrap_index(row, st->capacity[k]) * st->w;
+        run_operator(op, in, out, st->w, st->column_sums);
+        if (st->sink && k == st->pipeline->count - 1)
+            st->sink->row(st->sink->context, row, (const unsigned char *)out, st->w, sizeof(PPMPixel));
+        st->next[k]++;
+    }
+}
+
+/* Thread function for --pipeline. Runs the whole operator chain over rows start to start+size in one pass.
+   Each stage has to produce extra halo rows above and below the band, as many as the radii of all stages after it add up to.
+ */
+void *compute_pipeline_threadfn(void *params)
+{
+    struct parameter *param = (struct parameter *)params;
+    const struct pipeline *pl = param->pipeline;
+    struct hough_tile hough;
+    struct row_sink hough_sink = {hough_vote_row, &hough};
+    int voting = param->votes != NULL;
+    if (voting && hough_tile_begin(&hough, param->votes) != 0)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for Hough votes\n");
+        tile_failed(param);
+        return NULL;
+    }
+    struct pipeline_state st = {pl, &param->src, &param->dst, voting ? &hough_sink : NULL, (long)param->src.width,
+                                (long)param->src.height, NULL, NULL, 0, {NULL}, {0}, {0}, NULL};
+
+    long halo = 0;
+    for (int k = pl->count - 1; k >= 0; k--)
+    {
+        st.next[k] = (long)param->start - halo;
+        if (k < pl->count - 1)
+        {
+            st.capacity[k] = 2 * pl->ops[k + 1].radius + 1;
+            st.rings[k] = (PPMPixel *)malloc(st.capacity[k] * st.w * sizeof(PPMPixel));
+        }
+        halo += pl->ops[k].radius;
+    }
+    st.column_sums = (int *)malloc(3 * st.w * sizeof(int));
+    int rings_ok = 1;
+    for (int k = 0; k < pl->count - 1; k++)
+        rings_ok = rings_ok && st.rings[k];
+    int source_ok = 1;
+    if (is_bayer(param->src.format))
+    {
+        st.source_capacity = 2 * pl->ops[0].radius + 1;
+        st.source_ring = (PPMPixel *)malloc(st.source_capacity * st.w * sizeof(PPMPixel));
+        st.source_rows = (long *)malloc(st.source_capacity * sizeof(long));
+        source_ok = st.source_ring && st.source_rows;
+        for (int i = 0; source_ok && i < st.source_capacity; i++)
+            st.source_rows[i] = LONG_MIN;
+    }
+
+    if (st.column_sums && rings_ok && source_ok)
+        pipeline_advance(&st, pl->count - 1, (long)(param->start + param->size) - 1);
+    else
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for pipeline buffers\n");
+        tile_failed(param);
+    }
+
+    for (int k = 0; k < pl->count; k++)
+        free(st.rings[k]);
+    free(st.column_sums);
+    free(st.source_ring);
+    free(st.source_rows);
+    if (voting)
+        hough_tile_end(&hough);
+    return NULL;
+}
+
+/* Parse a pipeline spec such as "luma,blur:2,laplacian,threshold:40" (or with "->" between the operators).
+   A spec starting with '@' names a file that holds the spec instead.
+   Return: 0 on success, -1 (after printing why) if the spec is not valid.
+ */
+int parse_pipeline(const char *spec, struct pipeline *pl)
+{
+    char buffer[512];
+
+    if (spec[0] == '@')
+    {
+        FILE *fp = fopen(spec + 1, "r");
+        if (!fp)
+        {
+            fprintf(stderr, "Error: Unable to open pipeline file %s\n", spec + 1);
+            return -1;
+        }
+        size_t n = fread(buffer, 1, sizeof(buffer) - 1, fp);
+        fclose(fp);
+        buffer[n] = '\0';
+    }
+    else
+    {
+        snprintf(buffer, sizeof(buffer), "%s", spec);
+    }
+
+    // "a -> b" is accepted as well as "a,b"
+    for (char *arrow = strstr(buffer, "->"); arrow; arrow = strstr(arrow, "->"))
+        arrow[0] = arrow[1] = ',';
+
+    pl->count = 0;
+    for (char *tok = strtok(buffer, ", \t\r\n"); tok; tok = strtok(NULL, ", \t\r\n"))
+    {
+        if (pl->count == MAX_PIPELINE_OPS)
+        {
+            fprintf(stderr, "Error: Pipeline has more than %d operators\n", MAX_PIPELINE_OPS);
+            return -1;
+        }
+        struct pipeline_op *op = &pl->ops[pl->count++];
+        char *arg = strchr(tok, ':');
+        if (arg)
+            *arg++ = '\0';
+
+        op->radius = 0;
+        op->arg = 0;
+        char *end = NULL;
+        long value = arg ? strtol(arg, &end, 10) : 0;
+        if (arg && (end == arg || *end != '\0'))
+        {
+            fprintf(stderr, "Error: Argument '%s' of pipeline operator %s is not an integer\n", arg, tok);
+            return -1;
+        }
+        if (arg && (strcmp(tok, "luma") == 0 || strcmp(tok, "laplacian") == 0))
+        {
+            fprintf(stderr, "Error: Pipeline operator %s takes no argument\n", tok);
+            return -1;
+        }
+        if (strcmp(tok, "luma") == 0)
+            op->kind = OP_LUMA;
+        else if (strcmp(tok, "laplacian") == 0)
+        {
+            op->kind = OP_LAPLACIAN;
+            op->radius = 1;
+        }
+        else if (strcmp(tok, "blur") == 0)
+        {
+            op->kind = OP_BLUR;
+            if (arg && (value < 1 || value > MAX_FILTER_RADIUS))
+            {
+                fprintf(stderr, "Error: Blur radius must be between 1 and %d\n", MAX_FILTER_RADIUS);
+                return -1;
+            }
+            op->radius = arg ? (int)value : 1;
+        }
+        else if (strcmp(tok, "threshold") == 0)
+        {
+            op->kind = OP_THRESHOLD;
+            if (arg && (value < 0 || value > 255))
+            {
+                fprintf(stderr, "Error: Threshold level must be between 0 and 255\n");
+                return -1;
+            }
+            op->arg = arg ? (int)value : 128;
+        }
+        else
+        {
+            fprintf(stderr, "Error: Unknown pipeline operator '%s'\n", tok);
+            return -1;
+        }
+    }
+
+    if (pl->count == 0)
+    {
+        fprintf(stderr, "Error: Empty pipeline\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Buffer pool for image and result buffers. Freed buffers are kept (up to buffer_pool_limit bytes) and handed out
+   again to later images of the same or smaller size, so a batch doesn't keep going back to malloc.
+   Buffers from buffer_pool_get are plain malloc blocks and may be passed to free() instead of buffer_pool_put.
+ */
+#define BUFFER_POOL_SLOTS 16
+#define BUFFER_POOL_BYTES (256UL << 20) // default buffer_pool_limit
+
+static struct
+{
+    void *buffers[BUFFER_POOL_SLOTS];
+    size_t sizes[BUFFER_POOL_SLOTS];
+    int count;
+    size_t bytes;
+    pthread_mutex_t lock;
+} buffer_pool = {{NULL}, {0}, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+size_t buffer_pool_limit = BUFFER_POOL_BYTES; // bytes kept for reuse
+
+void *buffer_pool_get(size_t size)
+{
+    pthread_mutex_lock(&buffer_pool.lock);
+    int best = -1;
+    for (int i = 0; i < buffer_pool.count; i++)
+    {
+        if (buffer_pool.sizes[i] >= size && (best < 0 || buffer_pool.sizes[i] < buffer_pool.sizes[best]))
+            best = i;
+    }
+    if (best >= 0)
+    {
+        void *buffer = buffer_pool.buffers[best];
+        buffer_pool.bytes -= buffer_pool.sizes[best];
+        buffer_pool.count--;
+        buffer_pool.buffers[best] = buffer_pool.buffers[buffer_pool.count];
+        buffer_pool.sizes[best] = buffer_pool.sizes[buffer_pool.count];
+        pthread_mutex_unlock(&buffer_pool.lock);
+        return buffer;
+    }
+    pthread_mutex_unlock(&buffer_pool.lock);
+    return malloc(size);
+}
+
+void buffer_pool_put(void *buffer, size_t size)
+{
+    if (!buffer)
+        return;
+    pthread_mutex_lock(&buffer_pool.lock);
+    if (buffer_pool.count < BUFFER_POOL_SLOTS && buffer_pool.bytes + size <= buffer_pool_limit)
+    {
+        buffer_pool.buffers[buffer_pool.count] = buffer;
+        buffer_pool.sizes[buffer_pool.count] = size;
+        buffer_pool.count++;
+        buffer_pool.bytes += size;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&buffer_pool.lock);
+    free(buffer);
+}
+
+/* Free every pooled buffer and keep at most limit bytes from now on. */
+void buffer_pool_trim(size_t limit)
+{
+    pthread_mutex_lock(&buffer_pool.lock);
+    buffer_pool_limit = limit;
+    for (int i = 0; i < buffer_pool.count; i++)
+        free(buffer_pool.buffers[i]);
+    buffer_pool.count = 0;
+    buffer_pool.bytes = 0;
+    pthread_mutex_unlock(&buffer_pool.lock);
+}
+
+/* Bounded lock-free multi-producer/multi-consumer queue (a ring of cells with sequence numbers, after Vyukov).
+   Cell i starts with sequence i. A producer claims position pos by moving head from pos to pos + 1 once the
+   cell's sequence equals pos, stores its item and publishes it by setting the sequence to pos + 1; a consumer
+   claims pos from tail once the sequence equals pos + 1, takes the item and frees the cell for the next lap by
+   setting the sequence to pos + capacity. Producers and consumers only ever contend on head and tail respectively.
+   The blocking mpmc_push/mpmc_pop spin on the lock-free path and only sleep on a futex when the queue is full or
+   empty; the other side only touches the futex words (and makes the syscall) when somebody has gone to sleep.
+ */
+struct mpmc_cell
+{
+    unsigned long seq;
+    void *data;
+};
+
+struct mpmc_queue
+{
+    struct mpmc_cell *cells;
+    unsigned long mask;                              // capacity - 1, capacity is a power of two
+    unsigned long head __attribute__((aligned(64))); // next position to push
+    unsigned long tail __attribute__((aligned(64))); // next position to pop
+    // futex words, bumped when a pop (push) may have made room (an item) for a waiting pusher (popper)
+    unsigned int pops __attribute__((aligned(64)));
+    unsigned int pushes;
+    int push_sleepers, pop_sleepers; // set by a thread about to sleep, cleared by whoever wakes it
+};
+
+/* Set up q to hold at least capacity items. Return: 0, or -1 if out of memory. */
+int mpmc_init(struct mpmc_queue *q, unsigned long capacity)
+{
+    unsigned long size = 2;
+    while (size < capacity)
+        size <<= 1;
+    memset(q, 0, sizeof(*q));
+    q->cells = (struct mpmc_cell *)malloc(size * sizeof(struct mpmc_cell));
+    if (!q->cells)
+        return -1;
+    for (unsigned long i = 0; i < size; i++)
+        q->cells[i].seq = i;
+    q->mask = size - 1;
+    return 0;
+}
+
+void mpmc_destroy(struct mpmc_queue *q)
+{
+    free(q->cells);
+    q->cells = NULL;
+}
+
+/* Return: 1 if item was queued, 0 if the queue is full. Never blocks. */
+int mpmc_try_push(struct mpmc_queue *q, void *item)
+{
+    unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    struct mpmc_cell *cell;
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        long diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return 0; // the consumer of the previous lap hasn't freed the cell: full
+        else
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+    cell->data = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Return: 1 and the item in *item, or 0 if the queue is empty. Never blocks. */
+int mpmc_try_pop(struct mpmc_queue *q, void **item)
+{
+    unsigned long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    struct mpmc_cell *cell;
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        long diff = (long)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return 0; // nothing published in this cell yet: empty
+        else
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+    *item = cell->data;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void futex_wait(unsigned int *word, unsigned int seen)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake_all(unsigned int *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wake whoever sleeps on word, if anybody said so in sleepers. Called right after a successful push or pop.
+ Clearing sleepers means a burst of operations makes one wake-up call, not one each.
+ */
+static void mpmc_signal(unsigned int *word, int *sleepers)
+{
+    // order our cell update before reading sleepers, against the sleeper setting it before its last try
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(sleepers, __ATOMIC_RELAXED) && __atomic_exchange_n(sleepers, 0, __ATOMIC_SEQ_CST))
+    {
+        __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+        futex_wake_all(word); // the ones that still can't go on set sleepers again
+    }
+}
+
+#define MPMC_SPINS 64 // failed tries before going to sleep
+
+/* Queue item, sleeping while the queue is full. */
+void mpmc_push(struct mpmc_queue *q, void *item)
+{
+    for (int spin = 0; !mpmc_try_push(q, item); spin++)
+    {
+        if (spin < MPMC_SPINS)
+            continue;
+        unsigned int seen = __atomic_load_n(&q->pops, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&q->push_sleepers, 1, __ATOMIC_SEQ_CST);
+        if (mpmc_try_push(q, item))
+            break;
+        futex_wait(&q->pops, seen); // returns at once if a pop bumped the word since we read it
+    }
+    mpmc_signal(&q->pushes, &q->pop_sleepers);
+}
+
+/* Return: the next item, sleeping while the queue is empty. */
+void *mpmc_pop(struct mpmc_queue *q)
+{
+    void *item;
+    for (int spin = 0; !mpmc_try_pop(q, &item); spin++)
+    {
+        if (spin < MPMC_SPINS)
+            continue;
+        unsigned int seen = __atomic_load_n(&q->pushes, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&q->pop_sleepers, 1, __ATOMIC_SEQ_CST);
+        if (mpmc_try_pop(q, &item))
+            break;
+        futex_wait(&q->pushes, seen);
+    }
+    mpmc_signal(&q->pops, &q->push_sleepers);
+    return item;
+}
+
+/* Asynchronous filtering. A job is split into tiles (bands of rows) that the worker pool runs; the pool threads
+   are created once, on the first submission, and shared by every job afterwards. When the last tile of a job
+   is done the job's callback runs (on a pool thread), its event_fd (if any) is signalled and waiters wake up.
+ */
+struct filter_job;
+typedef void (*filter_callback)(struct filter_job *job, void *user_data);
+
+struct filter_job
+{
+    struct parameter *tiles; // one parameter block per tile
+    int tile_count;
+    int next_tile;           // next tile a worker will claim (protected by the pool lock)
+    int remaining;           // tiles not finished yet
+    filter_callback callback;
+    void *user_data;
+    int event_fd;            // eventfd to signal on completion, -1 for none
+    struct timeval start;
+    int tile_started;        // set by the first tile to run
+    struct timeval first_tile; // when that tile started, for the tile size controller
+    double elapsed_time;     // filled in on completion
+    int failed;              // set by a tile that couldn't do its part (out of memory)
+    int done;
+    int refs;                // the pool holds one reference until completion, the caller holds the other
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    struct filter_job *next; // next job in the pool queue
+};
+
+/* Jobs are queued per client and the pool shares its workers between clients by weighted fair queuing at tile
+   granularity: the next tile always comes from the client with the lowest virtual time, and running a tile of
+   p pixels advances its client's virtual time by p / weight. A client that was idle starts again from the pool's
+   current virtual time, so it can't bank credit while away. A bulk client therefore keeps the pool busy whenever
+   nobody else has work, but a light client's tiles are never stuck behind its whole backlog.
+ */
+struct client_queue
+{
+    char name[64];
+    double weight;
+    double vtime;                   // virtual time, in pixels / weight
+    struct filter_job *head, *tail; // jobs that still have tiles to hand out
+    // metrics, kept by the daemon (under the pool lock)
+    unsigned long images;              // FILTER requests served
+    double pixels;
+    double latency_total, latency_max; // seconds from request to reply
+    struct timeval first_seen;
+    struct client_queue *next;
+};
+
+#define MAX_POOL_THREADS 64
+
+struct worker_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_t threads[MAX_POOL_THREADS];
+    int size;                     // workers started, LAPLACIAN_THREADS unless the pool is elastic
+    int active;                   // workers allowed to take tiles, the others stay parked (see --elastic)
+    int elastic;
+    struct client_queue *clients; // every client ever seen, the default client first
+    double vclock;                // virtual time of the last tile handed out
+};
+
+static struct client_queue default_client = {"default", 1.0, 0, NULL, NULL, 0, 0, 0, 0, {0, 0}, NULL};
+static struct worker_pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, {0}, 0, 0, 0, &default_client, 0};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+/* Executor supplied by a host application (see filter_set_executor). submit must run task(arg) exactly once, on any thread. */
+typedef void (*executor_submit_fn)(void (*task)(void *), void *arg, void *executor_data);
+
+static executor_submit_fn executor_submit = NULL;
+static void *executor_data = NULL;
+static int filter_parallelism = LAPLACIAN_THREADS; // number of tiles each job is split into
+
+/* Adaptive tile height (--adaptive-tiles). Normally a job is cut into filter_parallelism equal bands; with the
+   controller on it is cut into bands of tiling.rows rows instead, and the controller tunes that number while the
+   batch runs. Each job's throughput is measured from when its first tile starts to when its last one finishes,
+   so it pays for both the per-tile overhead of small tiles and the idle workers at the tail of big ones.
+   Every ADAPT_WINDOW_JOBS jobs the controller compares the window's throughput with the previous window's and
+   moves the height by a factor of tiling.step: on in the same direction if it got faster, back the other way
+   with a smaller step if it got slower. The step never drops below ADAPT_MIN_STEP, so it keeps probing and
+   follows the load as it changes. Tiles always span the full width: the row kernels wrap around horizontally.
+ */
+#define ADAPT_WINDOW_JOBS 4
+#define ADAPT_MIN_STEP 1.125
+
+static struct
+{
+    int enabled;
+    int rows;                 // rows per tile right now
+    int min_rows, max_rows;
+    double step;              // factor the next move changes rows by
+    int direction;            // +1 growing, -1 shrinking
+    int window_jobs;
+    double window_pixels, window_time;
+    double last_throughput;   // pixels per second in the previous window, 0 before the first
+    pthread_mutex_t lock;
+} tiling = {0, 64, 8, 4096, 2.0, 1, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/* Feed a finished job (pixels filtered in seconds, first tile start to last tile end) to the tile size controller. */
+static void tiling_record_job(double pixels, double seconds)
+{
+    pthread_mutex_lock(&tiling.lock);
+    tiling.window_pixels += pixels;
+    tiling.window_time += seconds;
+    if (++tiling.window_jobs >= ADAPT_WINDOW_JOBS && tiling.window_time > 0)
+    {
+        double throughput = tiling.window_pixels / tiling.window_time;
+        if (tiling.last_throughput > 0 && throughput < tiling.last_throughput)
+        {
+            tiling.direction = -tiling.direction;
+            tiling.step = sqrt(tiling.step);
+            if (tiling.step < ADAPT_MIN_STEP)
+                tiling.step = ADAPT_MIN_STEP;
+        }
+        tiling.last_throughput = throughput;
+
+        int previous = tiling.rows;
+        double rows = tiling.direction > 0 ? tiling.rows * tiling.step : tiling.rows / tiling.step;
+        tiling.rows = rows < tiling.min_rows ? tiling.min_rows : rows > tiling.max_rows ? tiling.max_rows : (int)(rows + 0.5);
+        if (tiling.rows == previous && tiling.rows != (tiling.direction > 0 ? tiling.max_rows : tiling.min_rows))
+            tiling.rows += tiling.direction; // a small step may round back to the same height
+        if (tiling.rows == tiling.min_rows || tiling.rows == tiling.max_rows)
+            tiling.direction = tiling.rows == tiling.min_rows ? 1 : -1; // bounce off the bounds
+        fprintf(stderr, "Adaptive tiles: %.1f Mpixel/s with %d rows per tile, trying %d\n", throughput / 1e6, previous,
+                tiling.rows);
+
+        tiling.window_jobs = 0;
+        tiling.window_pixels = tiling.window_time = 0;
+    }
+    pthread_mutex_unlock(&tiling.lock);
+}
+
+static void filter_job_unref(struct filter_job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    int refs = --job->refs;
+    pthread_mutex_unlock(&job->lock);
+    if (refs == 0)
+    {
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->finished);
+        free(job->tiles);
+        free(job);
+    }
+}
+
+/* Called by the worker that finished the last tile of a job. */
+static void filter_job_complete(struct filter_job *job)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    job->elapsed_time = (end.tv_sec - job->start.tv_sec) + (end.tv_usec - job->start.tv_usec) / 1000000.0;
+    if (tiling.enabled)
+        tiling_record_job((double)job->tiles[0].src.width * job->tiles[0].src.height, (end.tv_sec - job->first_tile.tv_sec) +
+                                                                        (end.tv_usec - job->first_tile.tv_usec) / 1000000.0);
+
+    if (job->callback)
+        job->callback(job, job->user_data);
+
+    // mark the job done before signalling the eventfd, so a poll after the wakeup sees it finished
+    pthread_mutex_lock(&job->lock);
+    job->done = 1;
+    pthread_cond_broadcast(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+    if (job->event_fd >= 0)
+    {
+        uint64_t one = 1;
+        if (write(job->event_fd, &one, sizeof(one)) != sizeof(one))
+            fprintf(stderr, "Error: Unable to signal job completion\n");
+    }
+    filter_job_unref(job);
+}
+
+/* Called by a tile that couldn't filter its rows: the whole job is reported as failed. */
+static void tile_failed(struct parameter *param)
+{
+    __atomic_store_n(&param->job->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void run_tile(struct parameter *param)
+{
+    if (tiling.enabled && !__atomic_exchange_n(&param->job->tile_started, 1, __ATOMIC_ACQ_REL))
+        gettimeofday(&param->job->first_tile, NULL);
+    if (param->pipeline)
+        compute_pipeline_threadfn(param);
+    else
+        compute_laplacian_threadfn(param);
+
+    if (__atomic_sub_fetch(&param->job->remaining, 1, __ATOMIC_ACQ_REL) == 0)
+        filter_job_complete(param->job);
+}
+
+/* Return: the client with work whose virtual time is lowest, or NULL if nobody has work. Called with the pool lock held. */
+static struct client_queue *pool_next_client(void)
+{
+    struct client_queue *best = NULL;
+    for (struct client_queue *client = pool.clients; client; client = client->next)
+    {
+        if (client->head && (!best || client->vtime < best->vtime))
+            best = client;
+    }
+    return best;
+}
+
+/* Pool worker: claim the next tile of the most deserving client's first job and run it, forever.
+ arg is the worker's index; workers at or above pool.active are parked and take nothing.
+ */
+static void *pool_threadfn(void *arg)
+{
+    long index = (long)arg;
+    while (1)
+    {
+        struct client_queue *client;
+        pthread_mutex_lock(&pool.lock);
+        while (index >= pool.active || !(client = pool_next_client()))
+            pthread_cond_wait(&pool.work, &pool.lock);
+        struct filter_job *job = client->head;
+        struct parameter *tile = &job->tiles[job->next_tile++];
+        if (job->next_tile == job->tile_count)
+        {
+            client->head = job->next;
+            if (!client->head)
+                client->tail = NULL;
+        }
+        pool.vclock = client->vtime;
+        client->vtime += (double)tile->size * tile->src.width / client->weight;
+        pthread_mutex_unlock(&pool.lock);
+
+        run_tile(tile);
+    }
+    return NULL;
+}
+
+static void run_tile_task(void *arg)
+{
+    run_tile((struct parameter *)arg);
+}
+
+static void pool_start(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.size)
+        pool.size = pool.active = LAPLACIAN_THREADS;
+    int size = pool.size;
+    pthread_mutex_unlock(&pool.lock);
+    for (long i = 0; i < size; i++)
+    {
+        if (pthread_create(&pool.threads[i], NULL, pool_threadfn, (void *)i) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create pool thread %ld\n", i);
+            exit(1);
+        }
+    }
+}
+
+/* Get the queue of the client called name, creating it if needed, and set its weight (if weight > 0). */
+struct client_queue *pool_client(const char *name, double weight)
+{
+    pthread_mutex_lock(&pool.lock);
+    struct client_queue *client = pool.clients;
+    while (client && strcmp(client->name, name) != 0)
+        client = client->next;
+    if (!client && (client = (struct client_queue *)calloc(1, sizeof(struct client_queue))))
+    {
+        snprintf(client->name, sizeof(client->name), "%s", name);
+        client->weight = 1.0;
+        client->vtime = pool.vclock;
+        gettimeofday(&client->first_seen, NULL);
+        // keep the default client first, add the others after it
+        client->next = pool.clients->next;
+        pool.clients->next = client;
+    }
+    if (client && weight > 0)
+        client->weight = weight;
+    pthread_mutex_unlock(&pool.lock);
+    return client;
+}
+
+/* Filter the image src views into dst in the background, queueing the job's tiles for client (NULL for the default
+ client) so the pool shares its workers fairly between clients according to their weights. dst must have the size and
+ format of src and not overlap it; both must stay valid until the job is finished. If votes is not NULL (see
+ hough_init) the edges of the result vote into it. Otherwise like apply_filters_async.
+ */
+struct filter_job *filter_view_async(struct client_queue *client, const struct image_view *src, const struct image_view *dst,
+                                     struct hough_votes *votes, filter_callback callback, void *user_data, int event_fd)
+{
+    pthread_once(&laplacian_kernel_once, prepare_laplacian_kernel);
+
+    unsigned long h = src->height;
+    if (dst->width != src->width || dst->height != h || dst->format != filtered_format(src->format) ||
+        (filter_pipeline && dst->format != PIXEL_RGB24))
+    {
+        fprintf(stderr, "Error: Result view doesn't match the image view (or the pipeline needs RGB)\n");
+        return NULL;
+    }
+
+    struct filter_job *job = (struct filter_job *)calloc(1, sizeof(struct filter_job));
+    // an elastic pool splits each job between the workers it has active right now
+    int parallelism = filter_parallelism;
+    if (!executor_submit && pool.elastic)
+        parallelism = __atomic_load_n(&pool.active, __ATOMIC_RELAXED);
+    int tile_count = h < (unsigned long)parallelism ? (int)h : parallelism;
+    unsigned long rows = h / (tile_count ? tile_count : 1);
+    if (tiling.enabled)
+    {
+        rows = (unsigned long)__atomic_load_n(&tiling.rows, __ATOMIC_RELAXED);
+        if (rows > h)
+            rows = h;
+        tile_count = h ? (int)((h + rows - 1) / rows) : 0;
+    }
+    if (!job || tile_count == 0 || !(job->tiles = (struct parameter *)calloc(tile_count, sizeof(struct parameter))))
+    {
+        fprintf(stderr, "Error: Unable to create filter job\n");
+        free(job);
+        return NULL;
+    }
+
+    // rows rows per tile, the last tile takes the rest
+    for (int i = 0; i < tile_count; i++)
+    {
+        struct parameter *tile = &job->tiles[i];
+        tile->src = *src;
+        tile->dst = *dst;
+        tile->start = i * rows;
+        tile->size = (i == tile_count - 1) ? h - tile->start : rows;
+        tile->pipeline = filter_pipeline;
+        tile->kernel = filter_kernel;
+        tile->float_kernel = filter_float_kernel;
+        tile->votes = votes;
+        tile->job = job;
+    }
+    job->tile_count = tile_count;
+    job->remaining = tile_count;
+    job->callback = callback;
+    job->user_data = user_data;
+    job->event_fd = event_fd;
+    job->refs = 2;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    gettimeofday(&job->start, NULL);
+
+    if (executor_submit)
+    {
+        for (int i = 0; i < tile_count; i++)
+            executor_submit(run_tile_task, &job->tiles[i], executor_data);
+        return job;
+    }
+
+    if (!client)
+        client = &default_client;
+    pthread_once(&pool_once, pool_start);
+    pthread_mutex_lock(&pool.lock);
+    if (client->tail)
+    {
+        client->tail->next = job;
+    }
+    else
+    {
+        client->head = job;
+        if (client->vtime < pool.vclock)
+            client->vtime = pool.vclock; // was idle: no credit for the time away
+    }
+    client->tail = job;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    return job;
+}
+
+/* apply_filters_async for client (see filter_view_async). */
+struct filter_job *apply_filters_async_for(struct client_queue *client, PPMPixel *image, PPMPixel *result, unsigned long w,
+                                           unsigned long h, filter_callback callback, void *user_data, int event_fd)
+{
+    struct image_view src = packed_view(image, w, h), dst = packed_view(result, w, h);
+    return filter_view_async(client, &src, &dst, NULL, callback, user_data, event_fd);
+}
+
+/* Submit an image to be filtered in the background. result must hold w * h pixels and, like image, stay valid
+ until the job is finished. callback (may be NULL) is called from a pool (or executor) thread once result is complete,
+ and event_fd (an eventfd, or -1) is incremented by one at the same time.
+ The caller owns a reference to the job and must drop it with filter_job_wait or filter_job_release.
+ Return: the job, or NULL if it could not be created.
+ */
+struct filter_job *apply_filters_async(PPMPixel *image, PPMPixel *result, unsigned long w, unsigned long h,
+                                       filter_callback callback, void *user_data, int event_fd)
+{
+    return apply_filters_async_for(NULL, image, result, w, h, callback, user_data, event_fd);
+}
+
+/* Run the tiles of all jobs submitted from now on through the host application's own thread pool instead of the
+ internal one, so there is a single pool in the process. Each job is split into parallelism tiles, and every tile
+ is handed to submit(task, arg, data). Pass a NULL submit to go back to the internal pool.
+ Don't call the blocking apply_filters/filter_job_wait from inside an executor task: with every executor thread
+ waiting there may be nobody left to run the tiles. Use the callback or event_fd instead.
+ */
+void filter_set_executor(executor_submit_fn submit, void *data, int parallelism)
+{
+    executor_submit = submit;
+    executor_data = data;
+    filter_parallelism = parallelism > 0 ? parallelism : LAPLACIAN_THREADS;
+}
+
+/* Return: 1 if the job has finished, 0 if it is still running. Never blocks. */
+int filter_job_poll(struct filter_job *job)
+{
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    return done;
+}
+
+/* Return: 1 if a tile of the job failed, so its result is incomplete. Only meaningful once the job has finished
+   (e.g. in its callback).
+ */
+int filter_job_failed(const struct filter_job *job)
+{
+    return __atomic_load_n(&job->failed, __ATOMIC_RELAXED);
+}
+
+/* Block until the job has finished, store how long it took in *elapsed_time (if not NULL) and drop the caller's reference.
+ Return: 0, or -1 if a tile failed and the result is incomplete.
+ */
+int filter_job_wait(struct filter_job *job, double *elapsed_time)
+{
+    pthread_mutex_lock(&job->lock);
+    while (!job->done)
+        pthread_cond_wait(&job->finished, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    if (elapsed_time)
+        *elapsed_time = job->elapsed_time;
+    int failed = filter_job_failed(job);
+    filter_job_unref(job);
+    return failed ? -1 : 0;
+}
+
+/* Drop the caller's reference without waiting. Safe to call from the job's own callback;
+ an unfinished job keeps running and is freed when it completes.
+ */
+void filter_job_release(struct filter_job *job)
+{
+    filter_job_unref(job);
+}
+
+/* apply_filters on views: filter src into dst (see filter_view_async) and wait for it.
+ Return: 0 on success, -1 if the job could not be created or failed.
+ */
+int filter_view(const struct image_view *src, const struct image_view *dst, struct hough_votes *votes, double *elapsed_time)
+{
+    pthread_mutex_lock(&time_mutex);
+    struct filter_job *job = filter_view_async(NULL, src, dst, votes, NULL, NULL, -1);
+    if (!job)
+    {
+        pthread_mutex_unlock(&time_mutex);
+        return -1;
+    }
+    int status = filter_job_wait(job, elapsed_time);
+    pthread_mutex_unlock(&time_mutex);
+    return status;
+}
+
+/* Apply the Laplacian filter to an image using the worker pool.
+ The image is split into tiles with an equal share of the rows, i.e. work=height/number of threads. If the size is not even, the last tile takes the rest of the work.
+ Compute the elapsed time and store it in *elapsedTime (Read about gettimeofday).
+ Return: result (filtered image)
+ */
+PPMPixel *apply_filters(PPMPixel *image, unsigned long w, unsigned long h, double *elapsed_time)
+{
+    PPMPixel *result = (PPMPixel *)buffer_pool_get(w * h * sizeof(PPMPixel));
+    if (!result)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for result image\n");
+        return NULL;
+    }
+    struct image_view src = packed_view(image, w, h), dst = packed_view(result, w, h);
+    if (filter_view(&src, &dst, NULL, elapsed_time) != 0)
+    {
+        free(result); // ensure memory is freed before exit
+        return NULL;
+    }
+    return result;
+}
+
+/* Token-bucket bandwidth limits for the I/O stage (--read-limit/--write-limit, or RATE in daemon mode), so batch runs
+   don't starve co-located workloads of disk bandwidth. Every read or write of a chunk first takes its size in tokens
+   from the bucket; a caller that overdraws it sleeps until the refill at rate bytes per second has paid the debt back.
+ */
+#define IO_CHUNK_BYTES (256UL << 10) // reads are issued in chunks of this size
+#define WRITE_BAND_ROWS 64            // writes are issued (and checksummed) in bands of this many rows
+
+struct rate_limit
+{
+    double rate;                // bytes per second, 0 for no limit
+    double tokens;              // bytes that may be transferred right away (negative while in debt)
+    struct timeval last;        // time of the last refill
+    unsigned long long total;   // bytes transferred so far
+    pthread_mutex_t lock;
+};
+
+struct rate_limit read_limit = {0, 0, {0, 0}, 0, PTHREAD_MUTEX_INITIALIZER};
+struct rate_limit write_limit = {0, 0, {0, 0}, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/* Change the rate (bytes per second, 0 for no limit). Takes effect for the next chunk. */
+void rate_limit_set(struct rate_limit *rl, double rate)
+{
+    pthread_mutex_lock(&rl->lock);
+    rl->rate = rate > 0 ? rate : 0;
+    rl->tokens = 0;
+    gettimeofday(&rl->last, NULL);
+    pthread_mutex_unlock(&rl->lock);
+}
+
+void rate_limit_acquire(struct rate_limit *rl, size_t bytes)
+{
+    pthread_mutex_lock(&rl->lock);
+    rl->total += bytes;
+    if (rl->rate <= 0)
+    {
+        pthread_mutex_unlock(&rl->lock);
+        return;
+    }
+
+    // refill, allowing a burst of a tenth of a second (but at least one chunk)
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double burst = rl->rate / 10 > IO_CHUNK_BYTES ? rl->rate / 10 : IO_CHUNK_BYTES;
+    rl->tokens += ((now.tv_sec - rl->last.tv_sec) + (now.tv_usec - rl->last.tv_usec) / 1000000.0) * rl->rate;
+    if (rl->tokens > burst)
+        rl->tokens = burst;
+    rl->last = now;
+
+    rl->tokens -= bytes;
+    double wait = rl->tokens < 0 ? -rl->tokens / rl->rate : 0;
+    pthread_mutex_unlock(&rl->lock);
+
+    if (wait > 0)
+        usleep((useconds_t)(wait * 1000000));
+}
+
+/* Output checksums (--manifest). The writer hashes every band of WRITE_BAND_ROWS rows right before writing it,
+   while the band is still in cache, and the combined checksum is the hash of the band checksums (in order), seeded
+   with the image size. The hash is the single-lane form of xxHash64, fast and strong enough to catch corruption.
+ */
+
+struct output_checksum
+{
+    uint64_t combined;         // checksum of the whole image
+    uint64_t *bands;           // checksum of each band of rows
+    unsigned long band_count;
+    double write_time;         // seconds spent writing the file
+};
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t checksum_bytes(const void *data, size_t n, uint64_t seed)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t h = seed + PRIME64_5 + n;
+
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= rotl64(k * PRIME64_2, 31) * PRIME64_1;
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    for (; n > 0; p++, n--)
+    {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+FILE *manifest_file = NULL; // set by --manifest
+static pthread_mutex_t manifest_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Append one line for a written output to the manifest:
+ output path, width, height, combined checksum, band height, band checksums, filter time and write time (seconds).
+ */
+void append_manifest(const char *filename, unsigned long int width, unsigned long int height,
+                     const struct output_checksum *checksum, double filter_time)
+{
+    pthread_mutex_lock(&manifest_mutex);
+    if (ftell(manifest_file) == 0)
+        fprintf(manifest_file, "# output\twidth\theight\tchecksum\tband_rows\tband_checksums\tfilter_s\twrite_s\n");
+    fprintf(manifest_file, "%s\t%lu\t%lu\t%016llx\t%d\t", filename, width, height,
+            (unsigned long long)checksum->combined, WRITE_BAND_ROWS);
+    for (unsigned long i = 0; i < checksum->band_count; i++)
+        fprintf(manifest_file, "%s%016llx", i ? "," : "", (unsigned long long)checksum->bands[i]);
+    fprintf(manifest_file, "\t%.6f\t%.6f\n", filter_time, checksum->write_time);
+    fflush(manifest_file);
+    pthread_mutex_unlock(&manifest_mutex);
+}
+
+/* Write image, header and pixels, to fp at its current position: the pixel data goes out in bands of
+   WRITE_BAND_ROWS rows, each paced by the write rate limit and hashed into checksum if that isn't NULL (the caller
+   frees checksum->bands, except on error). A padded or cropped view is written without copying it whole, and a gray
+   one as a P5. Return: 0, or -1 (after printing why) if it couldn't be written.
+ */
+static int write_view(FILE *fp, const struct image_view *image, const char *filename, struct output_checksum *checksum)
+{
+    unsigned long int width = image->width, height = image->height;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    pthread_mutex_lock(&time_mutex);
+    // write the PPM (or PGM for gray views) header
+    fprintf(fp, "%s\n%lu %lu\n%d\n", image->format == PIXEL_GRAY8 ? "P5" : "P6", width, height, RGB_COMPONENT_COLOR);
+    pthread_mutex_unlock(&time_mutex);
+
+    unsigned long band_count = (height + WRITE_BAND_ROWS - 1) / WRITE_BAND_ROWS;
+    if (checksum)
+    {
+        checksum->band_count = band_count;
+        checksum->bands = (uint64_t *)malloc((band_count ? band_count : 1) * sizeof(uint64_t));
+        if (!checksum->bands)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for checksums\n");
+            return -1;
+        }
+    }
+
+    // rows that aren't packed are gathered band by band, so checksums and writes still see whole bands
+    size_t row_bytes = width * pixel_size(image->format);
+    unsigned char *gather = NULL;
+    if (image->stride != row_bytes && height > 0 && !(gather = (unsigned char *)malloc(WRITE_BAND_ROWS * row_bytes)))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for writing %s\n", filename);
+        if (checksum)
+            free(checksum->bands);
+        return -1;
+    }
+
+    // write the pixel data
+    for (unsigned long band = 0; band < band_count; band++)
+    {
+        unsigned long rows = (height - band * WRITE_BAND_ROWS < WRITE_BAND_ROWS) ? height - band * WRITE_BAND_ROWS : WRITE_BAND_ROWS;
+        const unsigned char *pixels = view_row(image, band * WRITE_BAND_ROWS);
+        if (gather)
+        {
+            for (unsigned long r = 0; r < rows; r++)
+                memcpy(gather + r * row_bytes, view_row(image, band * WRITE_BAND_ROWS + r), row_bytes);
+            pixels = gather;
+        }
+        size_t bytes = rows * row_bytes;
+        if (checksum)
+            checksum->bands[band] = checksum_bytes(pixels, bytes, band);
+        rate_limit_acquire(&write_limit, bytes);
+        if (fwrite(pixels, 1, bytes, fp) != bytes)
+        {
+            fprintf(stderr, "Error: Failed to write pixel data to file %s\n", filename);
+            free(gather);
+            if (checksum)
+                free(checksum->bands);
+            return -1;
+        }
+    }
+    free(gather);
+
+    if (checksum)
+    {
+        checksum->combined = checksum_bytes(checksum->bands, band_count * sizeof(uint64_t), ((uint64_t)width << 32) ^ height);
+        gettimeofday(&end, NULL);
+        checksum->write_time = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    }
+    return 0;
+}
+
+/* save_image for a view (see write_view). */
+int save_view(const struct image_view *image, const char *filename, struct output_checksum *checksum)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s for writing\n", filename);
+        return -1;
+    }
+    if (write_view(fp, image, filename, checksum) != 0)
+    {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+/*Create a new P6 file to save the filtered image in. Write the header block
+ e.g. P6
+      Width Height
+      Max color value
+ then write the image data.
+ The name of the new file shall be "filename" (the second argument).
+ The pixel data is written in bands of WRITE_BAND_ROWS rows, each paced by the write rate limit. If checksum is
+ not NULL every band is hashed on the way out (see struct output_checksum); the caller frees checksum->bands.
+ Return: 0 on success, -1 (after printing an error message) if the file could not be written.
+ */
+int save_image(PPMPixel *image, const char *filename, unsigned long int width, unsigned long int height, struct output_checksum *checksum)
+{
+    struct image_view view = packed_view(image, width, height);
+    return save_view(&view, filename, checksum);
+}
+
+/* Save the image with save_image, exiting if that fails. */
+void write_image(PPMPixel *image, char *filename, unsigned long int width, unsigned long int height, struct output_checksum *checksum)
+{
+    if (save_image(image, filename, width, height, checksum) != 0)
+        exit(1);
+}
+
+/* Memory-mapped output (--mmap-output). The output file is created at its final size (header + pixels) and
+   mapped, and the filter writes its result straight into the mapping, so there is no result buffer and no copy
+   through write(). When the image is complete it is finished band by band like save_image: checksummed, charged
+   to the write limit and, depending on the policy, flushed with msync (MS_ASYNC starts writeback, MS_SYNC waits
+   for it) and dropped from our address space with MADV_DONTNEED so a long batch doesn't keep every output mapped.
+ */
+enum msync_policy
+{
+    MSYNC_NONE,  // leave writeback to the kernel, like fclose
+    MSYNC_ASYNC,
+    MSYNC_SYNC
+};
+
+static struct
+{
+    int enabled;
+    enum msync_policy sync;
+    int dontneed;
+} mmap_output = {0, MSYNC_NONE, 0};
+
+struct mapped_image
+{
+    unsigned char *map;
+    size_t length;
+    size_t header;            // bytes of PPM header before the pixels
+    struct image_view pixels; // the payload, at whatever offset the header left it
+};
+
+/* Parse the --mmap-output policy: none, async or sync, optionally followed by ",dontneed". Return: 0, or -1 if invalid. */
+int parse_mmap_policy(const char *spec)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    for (char *tok = strtok(buffer, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (strcmp(tok, "none") == 0)
+            mmap_output.sync = MSYNC_NONE;
+        else if (strcmp(tok, "async") == 0)
+            mmap_output.sync = MSYNC_ASYNC;
+        else if (strcmp(tok, "sync") == 0)
+            mmap_output.sync = MSYNC_SYNC;
+        else if (strcmp(tok, "dontneed") == 0)
+            mmap_output.dontneed = 1;
+        else
+        {
+            fprintf(stderr, "Error: Unknown --mmap-output policy %s\n", tok);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Create filename as a width x height PPM, map it and fill in the header.
+ Return: where the pixels go, or NULL on error.
+ */
+PPMPixel *map_output_image(const char *filename, unsigned long int width, unsigned long int height, struct mapped_image *out)
+{
+    char header[64];
+    int header_length = snprintf(header, sizeof(header), "P6\n%lu %lu\n%d\n", width, height, RGB_COMPONENT_COLOR);
+    size_t length = header_length + width * height * sizeof(PPMPixel);
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Unable to open file %s for writing\n", filename);
+        return NULL;
+    }
+    if (ftruncate(fd, length) != 0)
+    {
+        fprintf(stderr, "Error: Unable to size file %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+    unsigned char *map = (unsigned char *)mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Unable to map file %s\n", filename);
+        return NULL;
+    }
+    memcpy(map, header, header_length);
+    out->map = map;
+    out->length = length;
+    out->header = header_length;
+    out->pixels = packed_view((PPMPixel *)(map + header_length), width, height);
+    return (PPMPixel *)(map + header_length);
+}
+
+/* Finish a mapped output once its pixels are complete: checksum (if checksum is not NULL) and flush it band by band
+ according to the msync policy, each msync paced by the write rate limit, then unmap it. With MSYNC_NONE nothing is
+ written here (the kernel writes the pages back whenever it likes), so nothing is rate limited either.
+ Return: 0 on success, -1 on error.
+ */
+int finish_output_image(struct mapped_image *m, const char *filename, unsigned long int width, unsigned long int height,
+                        struct output_checksum *checksum)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    long page = sysconf(_SC_PAGESIZE);
+    int status = 0;
+
+    unsigned long band_count = (height + WRITE_BAND_ROWS - 1) / WRITE_BAND_ROWS;
+    if (checksum && !(checksum->bands = (uint64_t *)malloc((band_count ? band_count : 1) * sizeof(uint64_t))))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for checksums\n");
+        munmap(m->map, m->length);
+        return -1;
+    }
+
+    const PPMPixel *image = (const PPMPixel *)(m->map + m->header);
+    for (unsigned long band = 0; band < band_count && status == 0; band++)
+    {
+        unsigned long rows = (height - band * WRITE_BAND_ROWS < WRITE_BAND_ROWS) ? height - band * WRITE_BAND_ROWS : WRITE_BAND_ROWS;
+        const PPMPixel *pixels = image + band * WRITE_BAND_ROWS * width;
+        size_t bytes = rows * width * sizeof(PPMPixel);
+        if (checksum)
+            checksum->bands[band] = checksum_bytes(pixels, bytes, band);
+        if (mmap_output.sync != MSYNC_NONE)
+            rate_limit_acquire(&write_limit, bytes);
+
+        // msync and madvise want page aligned ranges; the first band also covers the header
+        size_t first = band == 0 ? 0 : ((const unsigned char *)pixels - m->map) & ~(size_t)(page - 1);
+        size_t last = (const unsigned char *)pixels + bytes - m->map;
+        if (mmap_output.sync != MSYNC_NONE &&
+            msync(m->map + first, last - first, mmap_output.sync == MSYNC_SYNC ? MS_SYNC : MS_ASYNC) != 0)
+        {
+            fprintf(stderr, "Error: Failed to write pixel data to file %s\n", filename);
+            status = -1;
+        }
+        else if (mmap_output.dontneed)
+            madvise(m->map + first, last - first, MADV_DONTNEED);
+    }
+    munmap(m->map, m->length);
+
+    if (checksum && status != 0)
+        free(checksum->bands);
+    else if (checksum)
+    {
+        checksum->band_count = band_count;
+        checksum->combined = checksum_bytes(checksum->bands, band_count * sizeof(uint64_t), ((uint64_t)width << 32) ^ height);
+        gettimeofday(&end, NULL);
+        checksum->write_time = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    }
+    return status;
+}
+
+/* Parse the P6 header of an already opened image file, leaving fp at the first byte of pixel data.
+ Return: 0 on success, -1 (after printing an error message) if the header is invalid.
+ */
+int read_header(FILE *fp, const char *filename, unsigned long int *width, unsigned long int *height)
+{
+    // make sure right format
+    char magic[3];
+    if (!fgets(magic, sizeof(magic), fp) || strncmp(magic, "P6", 2) != 0)
+    {
+        fprintf(stderr, "Error: Invalid format in file %s\n", filename);
+        return -1;
+    }
+
+    // skip comments and read width, height, and max color value
+    unsigned long int local_width, local_height;
+    int max_color_value;
+
+    while (1)
+    {
+        char line[128];
+        if (!fgets(line, sizeof(line), fp))
+        {
+            fprintf(stderr, "Error: Unexpected end of file in header of %s\n", filename);
+            return -1;
+        }
+        if (line[0] == '#')
+            continue; // comment
+        if (sscanf(line, "%lu %lu", &local_width, &local_height) == 2)
+            break; // width and height
+    }
+
+    // read max color value
+    while (1)
+    {
+        char line[128];
+        if (!fgets(line, sizeof(line), fp))
+        {
+            fprintf(stderr, "Error: Unexpected end of file in header of %s\n", filename);
+            return -1;
+        }
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%d", &max_color_value) == 1)
+            break;
+    }
+
+    // make sure it's right
+    if (max_color_value != RGB_COMPONENT_COLOR)
+    {
+        fprintf(stderr, "Error: Invalid max color value in file %s\n", filename);
+        return -1;
+    }
+
+    *width = local_width;
+    *height = local_height;
+    return 0;
+}
+
+/* Read the pixel data following the header into dst, in chunks paced by the read rate limit. Packed views are read
+ in IO_CHUNK_BYTES chunks, padded or cropped ones a row at a time.
+ Return: 0 on success, -1 (after printing why) on a short read.
+ */
+static int read_pixels(FILE *fp, const char *filename, const struct image_view *dst)
+{
+    size_t row_bytes = dst->width * pixel_size(dst->format);
+    int packed = dst->stride == row_bytes;
+    size_t remaining = packed ? row_bytes * dst->height : row_bytes;
+    for (unsigned long y = 0; y < (packed ? 1 : dst->height); y++, remaining = row_bytes)
+    {
+        unsigned char *data = view_row(dst, y);
+        while (remaining > 0)
+        {
+            size_t chunk = remaining < IO_CHUNK_BYTES ? remaining : IO_CHUNK_BYTES;
+            rate_limit_acquire(&read_limit, chunk);
+            if (fread(data, 1, chunk, fp) != chunk)
+            {
+                fprintf(stderr, "Error: Unexpected end of file while reading pixel data in %s\n", filename);
+                return -1;
+            }
+            data += chunk;
+            remaining -= chunk;
+        }
+    }
+    return 0;
+}
+
+/* Read an image straight into a caller's view (e.g. rows padded for alignment), which must match its size and be RGB.
+ Return: 0 on success, -1 (after printing why) on error.
+ */
+int load_image_into(const char *filename, const struct image_view *dst)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return -1;
+    }
+    unsigned long int width, height;
+    int status = read_header(fp, filename, &width, &height);
+    if (status == 0 && (width != dst->width || height != dst->height || dst->format != PIXEL_RGB24))
+    {
+        fprintf(stderr, "Error: %s is %lux%lu RGB, not the size of the buffer given\n", filename, width, height);
+        status = -1;
+    }
+    if (status == 0)
+        status = read_pixels(fp, filename, dst);
+    fclose(fp);
+    return status;
+}
+
+/* load_image for a file that is already open (fp at the start of the image, named filename in messages).
+ Leaves fp open.
+ */
+PPMPixel *load_image_file(FILE *fp, const char *filename, unsigned long int *width, unsigned long int *height)
+{
+    unsigned long int local_width, local_height;
+    if (read_header(fp, filename, &local_width, &local_height) != 0)
+        return NULL;
+
+    // allocate mem
+    size_t pixel_count = local_width * local_height;
+    PPMPixel *image = (PPMPixel *)buffer_pool_get(pixel_count * sizeof(PPMPixel));
+    if (!image)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for image data\n");
+        return NULL;
+    }
+
+    struct image_view view = packed_view(image, local_width, local_height);
+    if (read_pixels(fp, filename, &view) != 0)
+    {
+        free(image);
+        return NULL;
+    }
+
+    *width = local_width;
+    *height = local_height;
+
+    return image;
+}
+
+/* Open the filename image for reading, and parse it.
+    Example of a ppm header:    //http://netpbm.sourceforge.net/doc/ppm.html
+    P6                  -- image format
+    # comment           -- comment lines begin with
+    ## another comment  -- any number of comment lines
+    200 300             -- image width & height
+    255                 -- max color value
+
+ Check if the image format is P6. If not, print invalid format error message.
+ If there are comments in the file, skip them. You may assume that comments exist only in the header block.
+ Read the image size information and store them in width and height.
+ Check the rgb component, if not 255, display error message.
+ Return: pointer to PPMPixel that has the pixel data of the input image (filename).The pixel data is stored in scanline order from left to right (up to bottom) in 3-byte chunks (r g b values for each pixel) encoded as binary numbers.
+ NULL (after printing an error message) if the file can't be read.
+ */
+PPMPixel *load_image(const char *filename, unsigned long int *width, unsigned long int *height)
+{
+    // open the file in binary mode
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return NULL;
+    }
+    PPMPixel *image = load_image_file(fp, filename, width, height);
+    fclose(fp);
+    return image;
+}
+
+/* Load the image with load_image, exiting if that fails. */
+PPMPixel *read_image(const char *filename, unsigned long int *width, unsigned long int *height)
+{
+    PPMPixel *image = load_image(filename, width, height);
+    if (!image)
+        exit(1);
+    return image;
+}
+
+/* Netpbm lets several images follow each other in one file (e.g. the frames of a capture, or pnmcat-style batches),
+   but load_image only ever reads the first. index_images finds them all: it parses a header, seeks over that image's
+   pixels to the next header and so on, so building the index reads nothing but the headers, however big the file.
+ */
+struct ppm_entry
+{
+    off_t payload; // offset of the first pixel
+    unsigned long int width, height;
+};
+
+/* Index every image in filename into *entries (malloc'd, the caller frees it).
+   Return: the number of images, or -1 (after printing why) if the file can't be read or an image is cut short.
+ */
+long index_images(const char *filename, struct ppm_entry **entries)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Error: %s isn't a regular file, can't index its images\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    struct ppm_entry *list = NULL;
+    long count = 0, capacity = 0;
+    int complete = 0;
+    while (1)
+    {
+        // anything but whitespace after an image starts another one
+        int c;
+        while ((c = fgetc(fp)) == ' ' || c == '\n' || c == '\r' || c == '\t')
+            ;
+        if (c == EOF)
+        {
+            complete = count > 0;
+            if (!complete)
+                fprintf(stderr, "Error: %s holds no image\n", filename);
+            break;
+        }
+        ungetc(c, fp);
+
+        struct ppm_entry entry;
+        if (read_header(fp, filename, &entry.width, &entry.height) != 0)
+            break;
+        entry.payload = ftello(fp);
+        off_t next = entry.payload + (off_t)(entry.width * entry.height * sizeof(PPMPixel));
+        if (next > st.st_size)
+        {
+            fprintf(stderr, "Error: Image %ld of %s is cut short\n", count + 1, filename);
+            break;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 8;
+            struct ppm_entry *grown = (struct ppm_entry *)realloc(list, capacity * sizeof(struct ppm_entry));
+            if (!grown)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory for the index of %s\n", filename);
+                break;
+            }
+            list = grown;
+        }
+        list[count++] = entry;
+        if (fseeko(fp, next, SEEK_SET) != 0)
+            break;
+    }
+    fclose(fp);
+    if (!complete)
+    {
+        free(list);
+        return -1;
+    }
+    *entries = list;
+    return count;
+}
+
+/* Parse "PATTERN:WxH" or "PATTERN:WxH:BITS" for --bayer (PATTERN is rggb, bggr, grbg or gbrg; BITS is 8, the
+ default, or 9 to 16 for samples stored in two bytes). Return: 0, or -1 (after printing why) if invalid.
+ */
+int parse_bayer_spec(const char *spec)
+{
+    static const char *const patterns[] = {"rggb", "grbg", "gbrg", "bggr"}; // red at (0,0), (1,0), (0,1), (1,1)
+    char pattern[8];
+    int bits = 8;
+    int n = sscanf(spec, "%7[a-z]:%lux%lu:%d", pattern, &bayer_input.width, &bayer_input.height, &bits);
+    if (n < 3 || bayer_input.width < 2 || bayer_input.height < 2 || bayer_input.width % 2 || bayer_input.height % 2 ||
+        bits < 8 || bits > 16)
+    {
+        fprintf(stderr, "Error: --bayer needs PATTERN:WxH[:BITS] with an even width and height and 8 to 16 bits\n");
+        return -1;
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        if (strcmp(pattern, patterns[i]) == 0)
+        {
+            bayer_input.red_x = i & 1;
+            bayer_input.red_y = i >> 1;
+            bayer_input.bits = bits;
+            bayer_input.enabled = 1;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Error: Unknown Bayer pattern %s (use rggb, bggr, grbg or gbrg)\n", pattern);
+    return -1;
+}
+
+/* Read a raw Bayer frame of the --bayer size (no header, one or two bytes a sample) into a pool buffer and set *view
+   to it. Return: the buffer, or NULL (after printing why) if the file can't be read or isn't exactly one frame.
+ */
+unsigned char *load_bayer(const char *filename, struct image_view *view)
+{
+    unsigned long int w = bayer_input.width, h = bayer_input.height;
+    enum pixel_format format = bayer_input.bits > 8 ? PIXEL_BAYER16 : PIXEL_BAYER8;
+    size_t bytes = w * h * pixel_size(format);
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size != bytes)
+    {
+        fprintf(stderr, "Error: %s has %lld bytes, a %lux%lu %d-bit Bayer frame has %zu\n", filename, (long long)st.st_size,
+                w, h, bayer_input.bits, bytes);
+        fclose(fp);
+        return NULL;
+    }
+    unsigned char *raw = (unsigned char *)buffer_pool_get(bytes);
+    if (!raw)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for image data\n");
+        fclose(fp);
+        return NULL;
+    }
+    struct image_view v = {raw, w, h, w * pixel_size(format), format};
+    if (read_pixels(fp, filename, &v) != 0)
+    {
+        free(raw);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    *view = v;
+    return raw;
+}
+
+/* Memory-pressure aware admission (--mem-pressure). Every image thread has to be admitted before it reads its
+   image. A monitor thread samples /proc/pressure/memory and the cgroup's memory usage against its limit every
+   PRESSURE_INTERVAL_MS: under pressure it halves the number of images admitted at once and empties the buffer pool,
+   and once pressure has cleared for a few samples it lets one more image in at a time until back to the full limit.
+ */
+#define PRESSURE_INTERVAL_MS 200
+#define PRESSURE_CLEAR_SAMPLES 5 // clear samples in a row needed before admitting more again
+#define MAX_PRESSURE_EVENTS 64
+
+struct pressure_event
+{
+    double when;   // seconds since the monitor started
+    double avg10;  // memory PSI "some avg10" (percent)
+    double usage;  // cgroup memory.current / memory.max, 0 if unlimited
+    int admitted;  // admission limit after the event
+};
+
+static struct
+{
+    int enabled;
+    double avg10_threshold;  // PSI avg10 at or above which we throttle (percent)
+    double usage_threshold;  // fraction of the cgroup limit at or above which we throttle
+    int limit;               // images admitted at once right now
+    int max_limit;
+    int running;             // images currently admitted
+    int min_limit;           // lowest limit reached, for the report
+    int throttles, resumes;
+    struct pressure_event events[MAX_PRESSURE_EVENTS];
+    int event_count;
+    int stop;
+    pthread_t monitor;
+    pthread_mutex_t lock;
+    pthread_cond_t admit;
+} pressure = {0, 10.0, 0.9, 0, 0, 0, 0, 0, 0, {{0, 0, 0, 0}}, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* Wait until the pressure monitor lets another image in. */
+void admit_image(void)
+{
+    if (!pressure.enabled)
+        return;
+    pthread_mutex_lock(&pressure.lock);
+    while (pressure.running >= pressure.limit)
+        pthread_cond_wait(&pressure.admit, &pressure.lock);
+    pressure.running++;
+    pthread_mutex_unlock(&pressure.lock);
+}
+
+void release_image(void)
+{
+    if (!pressure.enabled)
+        return;
+    pthread_mutex_lock(&pressure.lock);
+    pressure.running--;
+    pthread_cond_broadcast(&pressure.admit);
+    pthread_mutex_unlock(&pressure.lock);
+}
+
+static double read_number_file(const char *path, double missing)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return missing;
+    char line[64];
+    double value = missing;
+    if (fgets(line, sizeof(line), fp) && strncmp(line, "max", 3) != 0)
+        value = strtod(line, NULL);
+    fclose(fp);
+    return value;
+}
+
+/* Sample the memory PSI (some avg10, in percent) and the cgroup usage as a fraction of its limit (cgroup v2 first, then v1). */
+static void sample_memory_pressure(double *avg10, double *usage)
+{
+    *avg10 = 0;
+    FILE *fp = fopen("/proc/pressure/memory", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "some avg10=%lf", avg10) != 1)
+            *avg10 = 0;
+        fclose(fp);
+    }
+
+    double current = read_number_file("/sys/fs/cgroup/memory.current", -1);
+    double max = read_number_file("/sys/fs/cgroup/memory.max", -1);
+    if (current < 0)
+    {
+        current = read_number_file("/sys/fs/cgroup/memory/memory.usage_in_bytes", -1);
+        max = read_number_file("/sys/fs/cgroup/memory/memory.limit_in_bytes", -1);
+    }
+    // no limit shows up as "max" (v2) or as a huge page-rounded number (v1)
+    *usage = (current >= 0 && max > 0 && max < 9e18) ? current / max : 0;
+}
+
+static void record_pressure_event(double when, double avg10, double usage)
+{
+    if (pressure.event_count < MAX_PRESSURE_EVENTS)
+    {
+        struct pressure_event *e = &pressure.events[pressure.event_count++];
+        e->when = when;
+        e->avg10 = avg10;
+        e->usage = usage;
+        e->admitted = pressure.limit;
+    }
+}
+
+static void *pressure_monitor_threadfn(void *unused)
+{
+    (void)unused;
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    int clear_samples = 0;
+
+    while (1)
+    {
+        double avg10, usage;
+        sample_memory_pressure(&avg10, &usage);
+        gettimeofday(&now, NULL);
+        double when = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1000000.0;
+        int under_pressure = avg10 >= pressure.avg10_threshold || usage >= pressure.usage_threshold;
+
+        pthread_mutex_lock(&pressure.lock);
+        if (pressure.stop)
+        {
+            pthread_mutex_unlock(&pressure.lock);
+            break;
+        }
+        if (under_pressure)
+        {
+            clear_samples = 0;
+            if (pressure.limit > 1)
+            {
+                pressure.limit /= 2;
+                if (pressure.limit < pressure.min_limit)
+                    pressure.min_limit = pressure.limit;
+                pressure.throttles++;
+                record_pressure_event(when, avg10, usage);
+                buffer_pool_trim(0);
+            }
+        }
+        else if (++clear_samples >= PRESSURE_CLEAR_SAMPLES && pressure.limit < pressure.max_limit)
+        {
+            clear_samples = 0;
+            pressure.limit++;
+            if (pressure.limit == pressure.max_limit)
+                buffer_pool_trim(BUFFER_POOL_BYTES);
+            pressure.resumes++;
+            record_pressure_event(when, avg10, usage);
+            pthread_cond_broadcast(&pressure.admit);
+        }
+        pthread_mutex_unlock(&pressure.lock);
+
+        usleep(PRESSURE_INTERVAL_MS * 1000);
+    }
+    return NULL;
+}
+
+/* Start the pressure monitor, admitting at most max_images at once while there is no pressure. */
+void start_pressure_monitor(int max_images)
+{
+    pressure.enabled = 1;
+    pressure.limit = pressure.max_limit = pressure.min_limit = max_images;
+    if (pthread_create(&pressure.monitor, NULL, pressure_monitor_threadfn, NULL) != 0)
+    {
+        fprintf(stderr, "Error: Unable to create memory pressure monitor\n");
+        exit(1);
+    }
+}
+
+/* Stop the monitor and print what it did. */
+void stop_pressure_monitor(void)
+{
+    pthread_mutex_lock(&pressure.lock);
+    pressure.stop = 1;
+    pthread_mutex_unlock(&pressure.lock);
+    pthread_join(pressure.monitor, NULL);
+
+    printf("Memory pressure: throttled %d times, resumed %d times, lowest admission %d of %d images\n",
+           pressure.throttles, pressure.resumes, pressure.min_limit, pressure.max_limit);
+    for (int i = 0; i < pressure.event_count; i++)
+    {
+        const struct pressure_event *e = &pressure.events[i];
+        printf("  %8.3f s: avg10 %.2f%%, cgroup usage %.0f%% -> %d concurrent images\n", e->when, e->avg10,
+               e->usage * 100, e->admitted);
+    }
+}
+
+/* CPU quota tracking (--elastic). The pool starts one worker per CPU it may run on (at least LAPLACIAN_THREADS),
+   but only the first pool.active of them take tiles and the rest stay parked. A monitor thread reads the cgroup's
+   CPU quota every QUOTA_INTERVAL_MS (cpu.max on v2, cpu.cfs_quota_us / cpu.cfs_period_us on v1) and keeps as many
+   workers active as the quota buys CPUs, rounded up. Running more threads than that only gets the cgroup throttled
+   and stalls every tile in flight until the next period, so if nr_throttled in cpu.stat went up since the last
+   sample one more worker is parked, and after a few unthrottled samples in a row one is woken again.
+ */
+#define QUOTA_INTERVAL_MS 500
+#define QUOTA_CLEAR_SAMPLES 4 // unthrottled samples in a row needed before waking a worker again
+
+static struct
+{
+    int penalty;             // workers parked on top of what the quota allows, because of throttling
+    double nr_throttled;     // cpu.stat nr_throttled at the last sample
+    pthread_t monitor;
+} cpu_quota = {0, 0, 0};
+
+/* Return: the CPU quota of our cgroup in CPUs (quota / period), or 0 if it is unlimited or unknown. */
+static double read_cpu_quota(void)
+{
+    double quota = -1, period = 0;
+    FILE *fp = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (fp)
+    {
+        // "max 100000" when unlimited, which leaves quota at -1
+        if (fscanf(fp, "%lf %lf", &quota, &period) != 2)
+            quota = -1;
+        fclose(fp);
+    }
+    else
+    {
+        quota = read_number_file("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", -1);
+        period = read_number_file("/sys/fs/cgroup/cpu/cpu.cfs_period_us", 0);
+    }
+    return (quota > 0 && period > 0) ? quota / period : 0;
+}
+
+/* Return: the nr_throttled count of our cgroup's cpu.stat (v2, then v1), or -1 if there is none. */
+static double read_nr_throttled(void)
+{
+    FILE *fp = fopen("/sys/fs/cgroup/cpu.stat", "r");
+    if (!fp)
+        fp = fopen("/sys/fs/cgroup/cpu/cpu.stat", "r");
+    if (!fp)
+        return -1;
+    char key[64];
+    double value, throttled = -1;
+    while (fscanf(fp, "%63s %lf", key, &value) == 2)
+    {
+        if (strcmp(key, "nr_throttled") == 0)
+            throttled = value;
+    }
+    fclose(fp);
+    return throttled;
+}
+
+/* Sample the quota and the throttling counter and set the number of active pool workers to match. */
+static void update_active_workers(void)
+{
+    static int clear_samples = 0;
+    double cpus = read_cpu_quota();
+    double throttled = read_nr_throttled();
+
+    int allowed = cpus > 0 ? (int)ceil(cpus) : pool.size;
+    if (allowed > pool.size)
+        allowed = pool.size;
+    if (throttled > cpu_quota.nr_throttled)
+    {
+        clear_samples = 0;
+        if (cpu_quota.penalty < allowed - 1)
+            cpu_quota.penalty++;
+    }
+    else if (++clear_samples >= QUOTA_CLEAR_SAMPLES && cpu_quota.penalty > 0)
+    {
+        clear_samples = 0;
+        cpu_quota.penalty--;
+    }
+    if (throttled >= 0)
+        cpu_quota.nr_throttled = throttled;
+    int active = allowed - cpu_quota.penalty;
+    if (active < 1)
+        active = 1;
+
+    pthread_mutex_lock(&pool.lock);
+    int previous = pool.active;
+    pool.active = active;
+    pthread_cond_broadcast(&pool.work); // wake newly allowed workers, parked ones go back to sleep
+    pthread_mutex_unlock(&pool.lock);
+
+    if (active != previous)
+    {
+        if (cpus > 0)
+            fprintf(stderr, "Elastic pool: %d of %d workers active (quota %.2f CPUs, %.0f throttled periods)\n", active,
+                    pool.size, cpus, cpu_quota.nr_throttled);
+        else
+            fprintf(stderr, "Elastic pool: %d of %d workers active (no quota, %.0f throttled periods)\n", active,
+                    pool.size, cpu_quota.nr_throttled);
+    }
+}
+
+static void *cpu_quota_threadfn(void *unused)
+{
+    (void)unused;
+    while (1)
+    {
+        usleep(QUOTA_INTERVAL_MS * 1000);
+        update_active_workers();
+    }
+    return NULL;
+}
+
+/* Make the worker pool elastic. Must be called before the first image is filtered. */
+void start_cpu_quota_monitor(void)
+{
+    cpu_set_t cpus;
+    int size = LAPLACIAN_THREADS;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > size)
+        size = CPU_COUNT(&cpus);
+    if (size > MAX_POOL_THREADS)
+        size = MAX_POOL_THREADS;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.size = pool.active = size;
+    pool.elastic = 1;
+    pthread_mutex_unlock(&pool.lock);
+    cpu_quota.nr_throttled = read_nr_throttled();
+    update_active_workers();
+
+    if (pthread_create(&cpu_quota.monitor, NULL, cpu_quota_threadfn, NULL) != 0)
+    {
+        fprintf(stderr, "Error: Unable to create CPU quota monitor\n");
+        exit(1);
+    }
+    pthread_detach(cpu_quota.monitor);
+}
+
+/* Sampled edge-density triage (--triage). Instead of filtering the whole image, a random subset of
+   TRIAGE_TILE x TRIAGE_TILE tiles is read with pread (only the tile rows and columns plus the kernel's halo)
+   and the filter (the laplacian, --kernel or --float-kernel) is evaluated on them. A pixel counts as an edge if any
+   channel of its response reaches edge_threshold.
+ */
+#define TRIAGE_TILE 32
+
+struct triage_job
+{
+    const char *file_name;
+    int ok;              // set once the estimate is valid
+    double density;      // estimated fraction of edge pixels
+    double margin;       // half width of the 95% confidence interval
+    long tiles_sampled;
+    long tiles_total;
+};
+
+int triage_tiles = 32;     // tiles sampled per image
+
+static struct triage_job *triage_jobs;
+static int triage_job_count;
+static int triage_next_job;
+static pthread_mutex_t triage_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Read count pixels of row y starting at column x (both wrapped around the image edges) into out. */
+static int pread_pixels(int fd, off_t payload, long w, long h, long y, long x, long count, PPMPixel *out)
+{
+    y = wrap_index(y, h);
+    while (count > 0)
+    {
+        x = wrap_index(x, w);
+        long run = (w - x < count) ? w - x : count;
+        size_t bytes = run * sizeof(PPMPixel);
+        rate_limit_acquire(&read_limit, bytes);
+        if (pread(fd, out, bytes, payload + (off_t)(y * w + x) * sizeof(PPMPixel)) != (ssize_t)bytes)
+            return -1;
+        out += run;
+        x += run;
+        count -= run;
+    }
+    return 0;
+}
+
+/* Estimate the edge density of one image from a simple random sample of tiles (drawn without replacement).
+   The estimate is the ratio of edge pixels to pixels over the sampled tiles, and its confidence interval uses
+   the usual ratio-estimator variance with the finite population correction.
+ */
+static void triage_image(struct triage_job *job, unsigned long long seed)
+{
+    FILE *fp = fopen(job->file_name, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", job->file_name);
+        return;
+    }
+    unsigned long int width, height;
+    if (read_header(fp, job->file_name, &width, &height) != 0)
+    {
+        fclose(fp);
+        return;
+    }
+    off_t payload = ftell(fp);
+    int fd = fileno(fp);
+    long w = (long)width, h = (long)height;
+
+    long tiles_x = (w + TRIAGE_TILE - 1) / TRIAGE_TILE, tiles_y = (h + TRIAGE_TILE - 1) / TRIAGE_TILE;
+    long total = tiles_x * tiles_y;
+    long wanted = triage_tiles < total ? triage_tiles : total;
+
+    int radius = filter_float_kernel ? filter_float_kernel->size / 2 : filter_kernel->size / 2;
+    long side = TRIAGE_TILE + 2 * radius;
+    PPMPixel *in = (PPMPixel *)malloc(side * side * sizeof(PPMPixel));
+    PPMPixel *filtered = (PPMPixel *)malloc(side * TRIAGE_TILE * sizeof(PPMPixel));
+    double *edges = (double *)malloc(wanted * sizeof(double));
+    double *pixels = (double *)malloc(wanted * sizeof(double));
+    long n = 0;
+    if (!in || !filtered || !edges || !pixels)
+        fprintf(stderr, "Error: Unable to allocate memory for triage of %s\n", job->file_name);
+
+    // selection sampling (Knuth's algorithm S) visits the chosen tiles in file order
+    for (long t = 0; t < total && n < wanted && in && filtered && edges && pixels; t++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        if ((double)(seed >> 11) / 9007199254740992.0 * (total - t) >= wanted - n)
+            continue;
+
+        long x0 = (t % tiles_x) * TRIAGE_TILE, y0 = (t / tiles_x) * TRIAGE_TILE;
+        long tw = (w - x0 < TRIAGE_TILE) ? w - x0 : TRIAGE_TILE;
+        long th = (h - y0 < TRIAGE_TILE) ? h - y0 : TRIAGE_TILE;
+        // the tile with its halo is a little image of its own, filtered on its inner rows
+        long cols = tw + 2 * radius;
+        struct image_view window = packed_view(in, cols, th + 2 * radius), result = packed_view(filtered, cols, th);
+        int failed = 0;
+        for (long y = 0; y < th + 2 * radius && !failed; y++)
+            failed = pread_pixels(fd, payload, w, h, y0 + y - radius, x0 - radius, cols, in + y * cols);
+        if (failed)
+        {
+            fprintf(stderr, "Error: Unexpected end of file while reading pixel data in %s\n", job->file_name);
+            break;
+        }
+        if ((filter_float_kernel ? convolve_rows_float(filter_float_kernel, &window, &result, radius, radius + th, NULL)
+                                 : convolve_rows(filter_kernel, &window, &result, radius, radius + th, NULL)) != 0)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for triage of %s\n", job->file_name);
+            break;
+        }
+
+        long count = 0;
+        for (long y = 0; y < th; y++)
+        {
+            for (long x = radius; x < radius + tw; x++)
+            {
+                const PPMPixel *p = &filtered[y * cols + x];
+                if (p->r >= edge_threshold || p->g >= edge_threshold || p->b >= edge_threshold)
+                    count++;
+            }
+        }
+        edges[n] = (double)count;
+        pixels[n] = (double)(tw * th);
+        n++;
+    }
+    fclose(fp);
+
+    if (n == wanted && n > 0)
+    {
+        double sum_edges = 0, sum_pixels = 0;
+        for (long i = 0; i < n; i++)
+        {
+            sum_edges += edges[i];
+            sum_pixels += pixels[i];
+        }
+        double ratio = sum_edges / sum_pixels;
+        double residuals = 0;
+        for (long i = 0; i < n; i++)
+            residuals += (edges[i] - ratio * pixels[i]) * (edges[i] - ratio * pixels[i]);
+        double mean_pixels = sum_pixels / n;
+        double variance = n > 1 ? (1.0 - (double)n / total) * residuals / ((n - 1) * n * mean_pixels * mean_pixels) : 0;
+
+        job->density = ratio;
+        job->margin = 1.96 * sqrt(variance);
+        job->tiles_sampled = n;
+        job->tiles_total = total;
+        job->ok = 1;
+    }
+    free(in);
+    free(filtered);
+    free(edges);
+    free(pixels);
+}
+
+/* Worker thread for triage mode. Pulls the next image off the shared job list until none are left. */
+void *triage_threadfn(void *unused)
+{
+    (void)unused;
+    while (1)
+    {
+        pthread_mutex_lock(&triage_mutex);
+        int i = triage_next_job++;
+        pthread_mutex_unlock(&triage_mutex);
+        if (i >= triage_job_count)
+            break;
+
+        // seed from the file name so repeated runs sample the same tiles
+        unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+        for (const char *c = triage_jobs[i].file_name; *c; c++)
+            seed = (seed ^ (unsigned char)*c) * 0x100000001B3ULL;
+        triage_image(&triage_jobs[i], seed | 1);
+    }
+    return NULL;
+}
+
+/* Run triage over all the files and print one estimate per file, in argument order.
+ Return: 0 if every file could be estimated, 1 otherwise.
+ */
+int run_triage(char **files, int count)
+{
+    pthread_once(&laplacian_kernel_once, prepare_laplacian_kernel);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    triage_jobs = (struct triage_job *)calloc(count, sizeof(struct triage_job));
+    if (!triage_jobs)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for triage jobs\n");
+        return 1;
+    }
+    triage_job_count = count;
+    for (int i = 0; i < count; i++)
+        triage_jobs[i].file_name = files[i];
+
+    pthread_t threads[LAPLACIAN_THREADS];
+    for (int i = 0; i < LAPLACIAN_THREADS; i++)
+    {
+        if (pthread_create(&threads[i], NULL, triage_threadfn, NULL) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create triage thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < LAPLACIAN_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    gettimeofday(&end, NULL);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        struct triage_job *job = &triage_jobs[i];
+        if (!job->ok)
+        {
+            failures++;
+            continue;
+        }
+        printf("%s: edge density %.4f +/- %.4f (95%% CI, %ld of %ld tiles)\n", job->file_name, job->density,
+               job->margin, job->tiles_sampled, job->tiles_total);
+    }
+    printf("Triaged %d images in %.4f s (%.0f images/s)\n", count - failures, elapsed, elapsed > 0 ? count / elapsed : 0.0);
+    free(triage_jobs);
+    return failures ? 1 : 0;
+}
+
+/* Connected components of the edges (--components). Each of LAPLACIAN_THREADS bands of rows is filtered into a
+   band-sized buffer, thresholded like --triage does (a pixel is an edge if any channel reaches edge_threshold) and
+   labeled on its own with 8-connectivity, keeping the area and bounding box of each of its components and the
+   labels of its first and last rows. The bands' labels are then made global by giving each band a range of its own,
+   and one thread per seam between two bands joins the labels that touch across it in a shared union-find, using
+   compare-and-swap so seams sharing a band can be merged at the same time. No edge image is ever written.
+ */
+struct component
+{
+    unsigned long area;
+    unsigned long x0, y0, x1, y1; // bounding box, inclusive
+};
+
+struct component_band
+{
+    const struct image_view *image;
+    unsigned long start, size;      // rows of the band
+    int count;                      // components found in the band
+    int offset;                     // global label of the band's component 0
+    struct component *components;
+    int *first_row, *last_row;      // labels of the band's top and bottom rows, -1 where there is no edge
+    int *parent;                    // the shared union-find, over global labels
+    const struct component_band *below; // next band, for the seam job
+};
+
+int component_min_area = 64; // smallest component --components lists
+
+/* Return: the root of x's set, halving the path on the way. Safe against concurrent unions. */
+static int uf_find(int *parent, int x)
+{
+    while (1)
+    {
+        int p = __atomic_load_n(&parent[x], __ATOMIC_ACQUIRE);
+        if (p == x)
+            return x;
+        int grandparent = __atomic_load_n(&parent[p], __ATOMIC_ACQUIRE);
+        if (grandparent != p)
+            __atomic_compare_exchange_n(&parent[x], &p, grandparent, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        x = grandparent;
+    }
+}
+
+/* Join the sets of a and b, always hanging the larger root under the smaller, so concurrent unions can't make a cycle. */
+static void uf_union(int *parent, int a, int b)
+{
+    while (1)
+    {
+        a = uf_find(parent, a);
+        b = uf_find(parent, b);
+        if (a == b)
+            return;
+        if (a > b)
+        {
+            int t = a;
+            a = b;
+            b = t;
+        }
+        int expected = b;
+        if (__atomic_compare_exchange_n(&parent[b], &expected, a, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return;
+        // somebody else moved b meanwhile: look the roots up again
+    }
+}
+
+/* Filter, threshold and label one band. Runs in its own thread; labels stay local to the band. */
+static void *component_band_threadfn(void *arg)
+{
+    struct component_band *band = (struct component_band *)arg;
+    const struct image_view *image = band->image;
+    long w = image->width, rows = band->size;
+    PPMPixel *filtered = (PPMPixel *)malloc(w * rows * sizeof(PPMPixel));
+    int *labels = (int *)malloc(w * rows * sizeof(int));
+    // a pixel only starts a new provisional label if the one left of it is no edge: at most (w + 1) / 2 per row
+    int *local = (int *)malloc((rows * ((w + 1) / 2) + 1) * sizeof(int));
+    band->first_row = (int *)malloc(w * sizeof(int));
+    band->last_row = (int *)malloc(w * sizeof(int));
+    struct image_view out = packed_view(filtered, w, rows);
+    if (!filtered || !labels || !local || !band->first_row || !band->last_row ||
+        (filter_float_kernel ? convolve_rows_float(filter_float_kernel, image, &out, band->start, band->start + rows, NULL)
+                             : convolve_rows(filter_kernel, image, &out, band->start, band->start + rows, NULL)) != 0)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for component labels\n");
+        band->count = -1;
+        free(filtered);
+        free(labels);
+        free(local);
+        return NULL;
+    }
+
+    // first pass: provisional labels, noting which ones touch (neighbours to the left and in the row above)
+    int next = 0;
+    for (long y = 0; y < rows; y++)
+    {
+        for (long x = 0; x < w; x++)
+        {
+            const PPMPixel *p = &filtered[y * w + x];
+            int *label = &labels[y * w + x];
+            *label = -1;
+            if (p->r < edge_threshold && p->g < edge_threshold && p->b < edge_threshold)
+                continue;
+            int neighbours[4] = {x > 0 ? label[-1] : -1, y > 0 && x > 0 ? label[-w - 1] : -1, y > 0 ? label[-w] : -1,
+                                 y > 0 && x < w - 1 ? label[-w + 1] : -1};
+            for (int n = 0; n < 4; n++)
+            {
+                if (neighbours[n] < 0)
+                    continue;
+                if (*label < 0)
+                    *label = uf_find(local, neighbours[n]);
+                else
+                    uf_union(local, *label, neighbours[n]);
+            }
+            if (*label < 0)
+            {
+                local[next] = next;
+                *label = next++;
+            }
+        }
+    }
+
+    // second pass: number the roots 0..count-1 and collect their areas and bounding boxes
+    int *final = (int *)malloc((next ? next : 1) * sizeof(int));
+    band->components = (struct component *)calloc(next ? next : 1, sizeof(struct component));
+    if (!final || !band->components)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for component labels\n");
+        band->count = -1;
+        next = 0;
+    }
+    int count = 0;
+    for (int l = 0; l < next; l++)
+        final[l] = uf_find(local, l) == l ? count++ : -1;
+    for (long y = 0; y < rows && band->count >= 0; y++)
+    {
+        for (long x = 0; x < w; x++)
+        {
+            int *label = &labels[y * w + x];
+            if (*label < 0)
+                continue;
+            *label = final[uf_find(local, *label)];
+            struct component *c = &band->components[*label];
+            unsigned long gy = band->start + y;
+            if (c->area++ == 0)
+            {
+                c->x0 = c->x1 = x;
+                c->y0 = c->y1 = gy;
+            }
+            c->x0 = (unsigned long)x < c->x0 ? (unsigned long)x : c->x0;
+            c->x1 = (unsigned long)x > c->x1 ? (unsigned long)x : c->x1;
+            c->y1 = gy;
+        }
+    }
+    if (band->count >= 0)
+    {
+        band->count = count;
+        memcpy(band->first_row, labels, w * sizeof(int));
+        memcpy(band->last_row, labels + (rows - 1) * w, w * sizeof(int));
+    }
+
+    free(final);
+    free(filtered);
+    free(labels);
+    free(local);
+    return NULL;
+}
+
+/* Join the components touching across the seam between band and band->below (8-connectivity). */
+static void *component_seam_threadfn(void *arg)
+{
+    const struct component_band *band = (const struct component_band *)arg;
+    const struct component_band *below = band->below;
+    long w = band->image->width;
+    for (long x = 0; x < w; x++)
+    {
+        if (band->last_row[x] < 0)
+            continue;
+        for (long dx = -1; dx <= 1; dx++)
+        {
+            if (x + dx >= 0 && x + dx < w && below->first_row[x + dx] >= 0)
+                uf_union(band->parent, band->offset + band->last_row[x], below->offset + below->first_row[x + dx]);
+        }
+    }
+    return NULL;
+}
+
+static int compare_components(const void *a, const void *b)
+{
+    const struct component *x = (const struct component *)a, *y = (const struct component *)b;
+    return (x->area < y->area) - (x->area > y->area);
+}
+
+/* Label the edge components of one image and print them. Return: 0 on success, -1 on error. */
+static int label_components(const char *file_name)
+{
+    unsigned long int width, height;
+    PPMPixel *pixels = load_image(file_name, &width, &height);
+    if (!pixels)
+        return -1;
+    struct image_view image = packed_view(pixels, width, height);
+    pthread_once(&laplacian_kernel_once, prepare_laplacian_kernel);
+
+    int band_count = height < LAPLACIAN_THREADS ? (int)height : LAPLACIAN_THREADS;
+    struct component_band bands[LAPLACIAN_THREADS];
+    pthread_t threads[LAPLACIAN_THREADS];
+    memset(bands, 0, sizeof(bands));
+    for (int i = 0; i < band_count; i++)
+    {
+        bands[i].image = &image;
+        bands[i].start = i * (height / band_count);
+        bands[i].size = (i == band_count - 1) ? height - bands[i].start : height / band_count;
+        if (pthread_create(&threads[i], NULL, component_band_threadfn, &bands[i]) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create labeling thread %d\n", i);
+            exit(1);
+        }
+    }
+    int total = 0, status = 0;
+    for (int i = 0; i < band_count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (bands[i].count < 0)
+            status = -1;
+        bands[i].offset = total;
+        total += bands[i].count > 0 ? bands[i].count : 0;
+    }
+
+    // global labels: every band's components get a range of their own, then the seams are merged in parallel
+    int *parent = (int *)malloc((total ? total : 1) * sizeof(int));
+    struct component *merged = (struct component *)calloc(total ? total : 1, sizeof(struct component));
+    if (status == 0 && (!parent || !merged))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for component labels\n");
+        status = -1;
+    }
+    if (status == 0)
+    {
+        for (int l = 0; l < total; l++)
+            parent[l] = l;
+        for (int i = 0; i < band_count - 1; i++)
+        {
+            bands[i].parent = parent;
+            bands[i].below = &bands[i + 1];
+            if (pthread_create(&threads[i], NULL, component_seam_threadfn, &bands[i]) != 0)
+            {
+                fprintf(stderr, "Error: Unable to create seam thread %d\n", i);
+                exit(1);
+            }
+        }
+        for (int i = 0; i < band_count - 1; i++)
+            pthread_join(threads[i], NULL);
+
+        // fold every band component into its root
+        int count = 0;
+        for (int i = 0; i < band_count; i++)
+        {
+            for (int c = 0; c < bands[i].count; c++)
+            {
+                const struct component *from = &bands[i].components[c];
+                struct component *to = &merged[uf_find(parent, bands[i].offset + c)];
+                if (to->area == 0)
+                {
+                    count++;
+                    *to = *from;
+                    continue;
+                }
+                to->area += from->area;
+                to->x0 = from->x0 < to->x0 ? from->x0 : to->x0;
+                to->y0 = from->y0 < to->y0 ? from->y0 : to->y0;
+                to->x1 = from->x1 > to->x1 ? from->x1 : to->x1;
+                to->y1 = from->y1 > to->y1 ? from->y1 : to->y1;
+            }
+        }
+
+        qsort(merged, total, sizeof(struct component), compare_components);
+        int listed = 0;
+        while (listed < count && merged[listed].area >= (unsigned long)component_min_area)
+            listed++;
+        printf("%s: %d components (edge threshold %d), %d with area >= %d\n", file_name, count, edge_threshold, listed,
+               component_min_area);
+        for (int c = 0; c < listed; c++)
+        {
+            const struct component *comp = &merged[c];
+            printf("  area %8lu  bbox %lu,%lu %lux%lu\n", comp->area, comp->x0, comp->y0, comp->x1 - comp->x0 + 1,
+                   comp->y1 - comp->y0 + 1);
+        }
+    }
+
+    for (int i = 0; i < band_count; i++)
+    {
+        free(bands[i].components);
+        free(bands[i].first_row);
+        free(bands[i].last_row);
+    }
+    free(parent);
+    free(merged);
+    buffer_pool_put(pixels, width * height * sizeof(PPMPixel));
+    return status;
+}
+
+int run_components(char **files, int count)
+{
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (label_components(files[i]) != 0)
+            failures++;
+    }
+    return failures ? 1 : 0;
+}
+
+/* Pairwise change detection (--diff). The files are taken two at a time, as before and after pictures of the same
+   scene, and each pair is handled by a thread of its own in a single pass: both images are read band by band
+   (DIFF_BAND_ROWS rows plus the halo rows the kernel needs, wrapping around like the plain filter), both bands are
+   filtered into band buffers and the output row is |L(a) - L(b)| per channel, written out straight away. A pixel
+   changed if any channel of that reaches edge_threshold, and a DIFF_TILE x DIFF_TILE tile changed if at least
+   change_fraction of its pixels did; the tiles go to a PGM map with one (black or white) pixel per tile.
+ */
+#define DIFF_TILE 32
+#define DIFF_BAND_ROWS (2 * DIFF_TILE) // a whole number of tile rows, so tiles never straddle bands
+
+double change_fraction = 0.02;
+
+struct diff_job
+{
+    const char *before, *after;
+    char output_file_name[20];
+    char map_file_name[20];
+    int ok;
+    unsigned long tiles_changed, tiles_total;
+};
+
+/* Read n rows of an image starting at row y (wrapping around) into out, with one pread per run of rows that doesn't
+   wrap. Return: 0, or -1 on a short read.
+ */
+static int pread_rows(int fd, off_t payload, long w, long h, long y, long n, PPMPixel *out)
+{
+    while (n > 0)
+    {
+        y = wrap_index(y, h);
+        long run = (h - y < n) ? h - y : n;
+        size_t bytes = run * w * sizeof(PPMPixel);
+        rate_limit_acquire(&read_limit, bytes);
+        if (pread(fd, out, bytes, payload + (off_t)(y * w) * sizeof(PPMPixel)) != (ssize_t)bytes)
+            return -1;
+        out += run * w;
+        y += run;
+        n -= run;
+    }
+    return 0;
+}
+
+/* Open an image for band reading. Return: the descriptor (with size and payload offset filled in), or -1 on error. */
+static int open_image_rows(const char *filename, unsigned long int *width, unsigned long int *height, off_t *payload)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return -1;
+    }
+    int fd = -1;
+    if (read_header(fp, filename, width, height) == 0)
+    {
+        *payload = ftell(fp);
+        fd = dup(fileno(fp));
+    }
+    fclose(fp);
+    return fd;
+}
+
+static int diff_pair(struct diff_job *job)
+{
+    unsigned long int w, h, w2, h2;
+    off_t payload_a = 0, payload_b = 0;
+    int fd_a = open_image_rows(job->before, &w, &h, &payload_a);
+    int fd_b = fd_a < 0 ? -1 : open_image_rows(job->after, &w2, &h2, &payload_b);
+    if (fd_b >= 0 && (w != w2 || h != h2))
+        fprintf(stderr, "Error: %s is %lux%lu but %s is %lux%lu\n", job->before, w, h, job->after, w2, h2);
+    if (fd_b < 0 || w != w2 || h != h2)
+    {
+        if (fd_a >= 0)
+            close(fd_a);
+        if (fd_b >= 0)
+            close(fd_b);
+        return -1;
+    }
+
+    int radius = filter_float_kernel ? filter_float_kernel->size / 2 : filter_kernel->size / 2;
+    long band_rows = DIFF_BAND_ROWS + 2 * radius;
+    unsigned long tiles_x = (w + DIFF_TILE - 1) / DIFF_TILE, tiles_y = (h + DIFF_TILE - 1) / DIFF_TILE;
+    PPMPixel *in_a = (PPMPixel *)malloc(band_rows * w * sizeof(PPMPixel));
+    PPMPixel *in_b = (PPMPixel *)malloc(band_rows * w * sizeof(PPMPixel));
+    PPMPixel *out_a = (PPMPixel *)malloc(DIFF_BAND_ROWS * w * sizeof(PPMPixel));
+    PPMPixel *out_b = (PPMPixel *)malloc(DIFF_BAND_ROWS * w * sizeof(PPMPixel));
+    unsigned long *changed = (unsigned long *)calloc(tiles_x, sizeof(unsigned long)); // per tile of the current tile row
+    unsigned char *map = (unsigned char *)calloc(tiles_x * tiles_y, 1);
+    FILE *out = fopen(job->output_file_name, "wb");
+    int status = (in_a && in_b && out_a && out_b && changed && map) ? 0 : -1;
+    if (status != 0)
+        fprintf(stderr, "Error: Unable to allocate memory for %s\n", job->output_file_name);
+    else if (!out)
+    {
+        fprintf(stderr, "Error: Unable to open file %s for writing\n", job->output_file_name);
+        status = -1;
+    }
+    else
+        fprintf(out, "P6\n%lu %lu\n%d\n", w, h, RGB_COMPONENT_COLOR);
+
+    for (unsigned long y0 = 0; status == 0 && y0 < h; y0 += DIFF_BAND_ROWS)
+    {
+        long rows = h - y0 < DIFF_BAND_ROWS ? h - y0 : DIFF_BAND_ROWS;
+        // the band with its halo is a little image of its own, filtered on its inner rows
+        struct image_view band_a = packed_view(in_a, w, rows + 2 * radius), band_b = packed_view(in_b, w, rows + 2 * radius);
+        struct image_view filtered_a = packed_view(out_a, w, rows), filtered_b = packed_view(out_b, w, rows);
+        // the previous (full) band's last 2 * radius rows are this band's top halo, only the rest is read
+        long carry = y0 == 0 ? 0 : 2 * radius;
+        if (carry)
+        {
+            memmove(in_a, in_a + DIFF_BAND_ROWS * w, carry * w * sizeof(PPMPixel));
+            memmove(in_b, in_b + DIFF_BAND_ROWS * w, carry * w * sizeof(PPMPixel));
+        }
+        if (pread_rows(fd_a, payload_a, w, h, (long)y0 - radius + carry, rows + 2 * radius - carry, in_a + carry * w) != 0 ||
+            pread_rows(fd_b, payload_b, w, h, (long)y0 - radius + carry, rows + 2 * radius - carry, in_b + carry * w) != 0)
+        {
+            fprintf(stderr, "Error: Unexpected end of file while reading %s or %s\n", job->before, job->after);
+            status = -1;
+            break;
+        }
+        if (filter_float_kernel)
+            status = (convolve_rows_float(filter_float_kernel, &band_a, &filtered_a, radius, radius + rows, NULL) |
+                      convolve_rows_float(filter_float_kernel, &band_b, &filtered_b, radius, radius + rows, NULL));
+        else
+            status = (convolve_rows(filter_kernel, &band_a, &filtered_a, radius, radius + rows, NULL) |
+                      convolve_rows(filter_kernel, &band_b, &filtered_b, radius, radius + rows, NULL));
+        if (status != 0)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for %s\n", job->output_file_name);
+            break;
+        }
+
+        // |L(a) - L(b)| goes into out_a, counting the changed pixels of each tile on the way
+        unsigned char *a = (unsigned char *)out_a;
+        const unsigned char *b = (const unsigned char *)out_b;
+        for (long r = 0; r < rows; r++)
+        {
+            for (unsigned long x = 0; x < w; x++, a += 3, b += 3)
+            {
+                int hit = 0;
+                for (int c = 0; c < 3; c++)
+                {
+                    a[c] = (unsigned char)abs(a[c] - b[c]);
+                    hit |= a[c] >= edge_threshold;
+                }
+                changed[x / DIFF_TILE] += hit;
+            }
+            unsigned long y = y0 + r;
+            if ((y + 1) % DIFF_TILE == 0 || y + 1 == h)
+            {
+                // a row of tiles is complete
+                unsigned long tile_y = y / DIFF_TILE, tile_h = y - tile_y * DIFF_TILE + 1;
+                for (unsigned long tx = 0; tx < tiles_x; tx++)
+                {
+                    unsigned long tile_w = (tx == tiles_x - 1) ? w - tx * DIFF_TILE : DIFF_TILE;
+                    if (changed[tx] >= change_fraction * tile_w * tile_h && changed[tx] > 0)
+                    {
+                        map[tile_y * tiles_x + tx] = 255;
+                        job->tiles_changed++;
+                    }
+                    changed[tx] = 0;
+                }
+            }
+        }
+
+        size_t bytes = rows * w * sizeof(PPMPixel);
+        rate_limit_acquire(&write_limit, bytes);
+        if (fwrite(out_a, 1, bytes, out) != bytes)
+        {
+            fprintf(stderr, "Error: Failed to write pixel data to file %s\n", job->output_file_name);
+            status = -1;
+        }
+    }
+    if (out && fclose(out) != 0)
+        status = -1;
+
+    if (status == 0)
+    {
+        struct image_view map_view = {map, tiles_x, tiles_y, tiles_x, PIXEL_GRAY8};
+        job->tiles_total = tiles_x * tiles_y;
+        status = save_view(&map_view, job->map_file_name, NULL);
+    }
+    close(fd_a);
+    close(fd_b);
+    free(in_a);
+    free(in_b);
+    free(out_a);
+    free(out_b);
+    free(changed);
+    free(map);
+    return status;
+}
+
+static void *diff_threadfn(void *arg)
+{
+    struct diff_job *job = (struct diff_job *)arg;
+    job->ok = diff_pair(job) == 0;
+    return NULL;
+}
+
+int run_diff(char **files, int count)
+{
+    if (count % 2 != 0)
+    {
+        fprintf(stderr, "Error: --diff needs the files in before/after pairs\n");
+        return 1;
+    }
+    pthread_once(&laplacian_kernel_once, prepare_laplacian_kernel);
+
+    int pairs = count / 2;
+    struct diff_job jobs[pairs];
+    pthread_t threads[pairs];
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < pairs; i++)
+    {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].before = files[2 * i];
+        jobs[i].after = files[2 * i + 1];
+        sprintf(jobs[i].output_file_name, "diff%d.ppm", i + 1);
+        sprintf(jobs[i].map_file_name, "change%d.pgm", i + 1);
+        if (pthread_create(&threads[i], NULL, diff_threadfn, &jobs[i]) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create diff thread %d\n", i);
+            exit(1);
+        }
+    }
+    int failures = 0;
+    for (int i = 0; i < pairs; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (!jobs[i].ok)
+        {
+            failures++;
+            continue;
+        }
+        printf("%s -> %s: %lu of %lu tiles changed (%.1f%%), see %s and %s\n", jobs[i].before, jobs[i].after,
+               jobs[i].tiles_changed, jobs[i].tiles_total, 100.0 * jobs[i].tiles_changed / jobs[i].tiles_total,
+               jobs[i].output_file_name, jobs[i].map_file_name);
+    }
+    gettimeofday(&end, NULL);
+    printf("Total elapsed time: %.4f s\n", (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
+    return failures ? 1 : 0;
+}
+
+/* Raw YUV input (--yuv=FORMAT:WxH). Each file is a stream of I420 or NV12 frames: a W x H luma (Y) plane followed
+   by the chroma at quarter resolution, W * H / 2 bytes either planar (I420) or interleaved (NV12), which we skip.
+   The filter runs on the Y plane as a gray view, so the integer kernels go through the SIMD engine one byte per
+   pixel and there is no colour conversion at all. Frames stream through YUV_FRAMES_IN_FLIGHT slots: while the pool
+   filters one frame the next ones are already being read, and finished frames are appended in order to the output
+   as P5 images, one after the other in the same file.
+ */
+#define YUV_FRAMES_IN_FLIGHT 4
+
+enum yuv_format
+{
+    YUV_I420,
+    YUV_NV12
+};
+
+static struct
+{
+    int enabled;
+    enum yuv_format format;
+    unsigned long int width, height;
+} yuv_input = {0, YUV_I420, 0, 0};
+
+/* Parse "i420:WxH" or "nv12:WxH". Return: 0, or -1 (after printing why) if invalid. */
+int parse_yuv_spec(const char *spec)
+{
+    char format[8];
+    if (sscanf(spec, "%7[a-z0-9]:%lux%lu", format, &yuv_input.width, &yuv_input.height) != 3 || yuv_input.width < 2 ||
+        yuv_input.height < 2 || yuv_input.width % 2 || yuv_input.height % 2)
+    {
+        fprintf(stderr, "Error: --yuv needs FORMAT:WxH with an even width and height, e.g. i420:1920x1080\n");
+        return -1;
+    }
+    if (strcmp(format, "i420") == 0)
+        yuv_input.format = YUV_I420;
+    else if (strcmp(format, "nv12") == 0)
+        yuv_input.format = YUV_NV12;
+    else
+    {
+        fprintf(stderr, "Error: Unknown YUV format %s (use i420 or nv12)\n", format);
+        return -1;
+    }
+    yuv_input.enabled = 1;
+    return 0;
+}
+
+struct yuv_frame
+{
+    unsigned char *luma, *result;
+    struct filter_job *job;   // NULL when the slot is free
+};
+
+/* Wait for the frame in slot and append its result to out. Return: 0, or -1 if it couldn't be written. */
+static int finish_yuv_frame(struct yuv_frame *slot, FILE *out, const char *output_file_name, double *elapsed_total)
+{
+    unsigned long int w = yuv_input.width, h = yuv_input.height;
+    double elapsed_time;
+    int failed = filter_job_wait(slot->job, &elapsed_time);
+    slot->job = NULL;
+    *elapsed_total += elapsed_time;
+    if (failed)
+        return -1;
+
+    rate_limit_acquire(&write_limit, w * h);
+    fprintf(out, "P5\n%lu %lu\n%d\n", w, h, RGB_COMPONENT_COLOR);
+    if (fwrite(slot->result, 1, w * h, out) != w * h)
+    {
+        fprintf(stderr, "Error: Failed to write pixel data to file %s\n", output_file_name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Filter every frame of one YUV file into output_file_name. Return: frames done, or -1 on error. */
+static long filter_yuv_file(const char *filename, const char *output_file_name, double *elapsed_total)
+{
+    unsigned long int w = yuv_input.width, h = yuv_input.height;
+    size_t luma_bytes = w * h, chroma_bytes = w * h / 2;
+    FILE *in = fopen(filename, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return -1;
+    }
+    FILE *out = fopen(output_file_name, "wb");
+    if (!out)
+    {
+        fprintf(stderr, "Error: Unable to open file %s for writing\n", output_file_name);
+        fclose(in);
+        return -1;
+    }
+
+    struct yuv_frame slots[YUV_FRAMES_IN_FLIGHT];
+    memset(slots, 0, sizeof(slots));
+    long frames = 0, status = 0;
+    // seeking over the chroma can't notice a short last frame, so check the size up front when there is one
+    struct stat st;
+    if (fstat(fileno(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size % (luma_bytes + chroma_bytes))
+    {
+        fprintf(stderr, "Error: %s ends in the middle of frame %ld (is it %s %lux%lu?)\n", filename,
+                (long)(st.st_size / (luma_bytes + chroma_bytes)) + 1, yuv_input.format == YUV_NV12 ? "nv12" : "i420", w, h);
+        status = -1;
+    }
+    for (int i = 0; i < YUV_FRAMES_IN_FLIGHT; i++)
+    {
+        slots[i].luma = (unsigned char *)malloc(luma_bytes);
+        slots[i].result = (unsigned char *)malloc(luma_bytes);
+        if (!slots[i].luma || !slots[i].result)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for YUV frames\n");
+            status = -1;
+        }
+    }
+
+    while (status == 0)
+    {
+        struct yuv_frame *slot = &slots[frames % YUV_FRAMES_IN_FLIGHT];
+        if (slot->job && finish_yuv_frame(slot, out, output_file_name, elapsed_total) != 0)
+        {
+            status = -1;
+            break;
+        }
+
+        rate_limit_acquire(&read_limit, luma_bytes);
+        size_t got = fread(slot->luma, 1, luma_bytes, in);
+        if (got == 0 && feof(in))
+            break;
+        // the chroma isn't needed: seek over it, or read it away if the input is a pipe
+        unsigned char skip[4096];
+        size_t skipped = 0;
+        if (got == luma_bytes && fseek(in, chroma_bytes, SEEK_CUR) == 0)
+            skipped = chroma_bytes;
+        while (got == luma_bytes && skipped < chroma_bytes)
+        {
+            size_t n = fread(skip, 1, chroma_bytes - skipped < sizeof(skip) ? chroma_bytes - skipped : sizeof(skip), in);
+            if (n == 0)
+                break;
+            skipped += n;
+        }
+        if (got != luma_bytes || skipped != chroma_bytes)
+        {
+            fprintf(stderr, "Error: %s ends in the middle of frame %ld (is it %s %lux%lu?)\n", filename, frames + 1,
+                    yuv_input.format == YUV_NV12 ? "nv12" : "i420", w, h);
+            status = -1;
+            break;
+        }
+
+        struct image_view src = {slot->luma, w, h, w, PIXEL_GRAY8}, dst = {slot->result, w, h, w, PIXEL_GRAY8};
+        if (!(slot->job = filter_view_async(NULL, &src, &dst, NULL, NULL, NULL, -1)))
+        {
+            status = -1;
+            break;
+        }
+        frames++;
+    }
+
+    // drain the frames still in flight, oldest first
+    for (long f = frames; f < frames + YUV_FRAMES_IN_FLIGHT; f++)
+    {
+        struct yuv_frame *slot = &slots[f % YUV_FRAMES_IN_FLIGHT];
+        if (slot->job && finish_yuv_frame(slot, out, output_file_name, elapsed_total) != 0)
+            status = -1;
+    }
+    for (int i = 0; i < YUV_FRAMES_IN_FLIGHT; i++)
+    {
+        free(slots[i].luma);
+        free(slots[i].result);
+    }
+    fclose(in);
+    if (fclose(out) != 0)
+        status = -1;
+    return status == 0 ? frames : -1;
+}
+
+int run_yuv(char **files, int count)
+{
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char output_file_name[24];
+        sprintf(output_file_name, "laplacian%d.pgm", i + 1);
+        long frames = filter_yuv_file(files[i], output_file_name, &total_elapsed_time);
+        if (frames < 0)
+            failures++;
+        else
+            printf("%s: %ld frames -> %s\n", files[i], frames, output_file_name);
+    }
+    printf("Total elapsed time: %.4f s\n", total_elapsed_time);
+    return failures ? 1 : 0;
+}
+
+/* Mask-guided sparse filtering (--mask=FILE). The mask is a PBM (P4, black is inside) or PGM (P5, non-zero is inside)
+   of the same size as the images. Only the MASK_TILE x MASK_TILE tiles that have a mask pixel in them are filtered:
+   for each row of tiles, the runs of such tiles are read with pread (plus the halo the kernel needs, wrapping around
+   like the plain filter), filtered as a little image of their own and written with pwrite, so the rest of the image is
+   never read, filtered or written. Outside the mask the output is black (the file is created at full size first, which
+   leaves holes where nothing gets written), or with --mask-outside=keep whatever an existing laplacianN.ppm of the same
+   size had there. Each file gets a thread; the number of tiles skipped is reported.
+ */
+#define MASK_TILE 32
+
+static const char *mask_file_name = NULL;
+static int mask_keep_outside = 0; // --mask-outside=keep
+
+struct mask
+{
+    unsigned char *inside; // one byte per pixel, 1 inside the mask
+    unsigned long int width, height;
+    unsigned char *tiles;  // one byte per tile, 1 if the tile has a pixel inside
+    unsigned long int tiles_x, tiles_y, tile_count;
+};
+
+struct mask_job
+{
+    const char *input_file_name;
+    char output_file_name[20];
+    const struct mask *mask;
+    int ok;
+    unsigned long tiles_filtered;
+};
+
+/* Read the next number of a netpbm header, skipping whitespace and comments, and the whitespace character after it.
+   Return: 0, or -1 if there is no number.
+ */
+static int read_pnm_number(FILE *fp, unsigned long *value)
+{
+    int c;
+    while ((c = fgetc(fp)) != EOF)
+    {
+        if (c == '#')
+        {
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+            break;
+    }
+    if (c < '0' || c > '9')
+        return -1;
+    for (*value = 0; c >= '0' && c <= '9'; c = fgetc(fp))
+        *value = *value * 10 + (c - '0');
+    return 0;
+}
+
+/* Load a P4 or P5 mask and find the tiles it touches. Return: 0, or -1 (after printing why). */
+int load_mask(const char *filename, struct mask *m)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        return -1;
+    }
+    int p = fgetc(fp), kind = fgetc(fp);
+    unsigned long maxval = 1;
+    if (p != 'P' || (kind != '4' && kind != '5') || read_pnm_number(fp, &m->width) != 0 ||
+        read_pnm_number(fp, &m->height) != 0 || (kind == '5' && read_pnm_number(fp, &maxval) != 0) || m->width == 0 ||
+        m->height == 0 || maxval == 0 || maxval > 65535)
+    {
+        fprintf(stderr, "Error: %s isn't a binary PBM (P4) or PGM (P5) mask\n", filename);
+        fclose(fp);
+        return -1;
+    }
+
+    unsigned long w = m->width, h = m->height;
+    size_t row_bytes = kind == '4' ? (w + 7) / 8 : w * (maxval > 255 ? 2 : 1);
+    unsigned char *row = (unsigned char *)malloc(row_bytes);
+    m->inside = (unsigned char *)malloc(w * h);
+    m->tiles_x = (w + MASK_TILE - 1) / MASK_TILE;
+    m->tiles_y = (h + MASK_TILE - 1) / MASK_TILE;
+    m->tile_count = m->tiles_x * m->tiles_y;
+    m->tiles = (unsigned char *)calloc(m->tile_count, 1);
+    int status = (row && m->inside && m->tiles) ? 0 : -1;
+    if (status != 0)
+        fprintf(stderr, "Error: Unable to allocate memory for mask %s\n", filename);
+
+    for (unsigned long y = 0; status == 0 && y < h; y++)
+    {
+        if (fread(row, 1, row_bytes, fp) != row_bytes)
+        {
+            fprintf(stderr, "Error: Unexpected end of file while reading pixel data in %s\n", filename);
+            status = -1;
+            break;
+        }
+        unsigned char *inside = m->inside + y * w;
+        for (unsigned long x = 0; x < w; x++)
+        {
+            if (kind == '4')
+                inside[x] = (row[x / 8] >> (7 - x % 8)) & 1;
+            else
+                inside[x] = maxval > 255 ? (row[2 * x] | row[2 * x + 1]) != 0 : row[x] != 0;
+            if (inside[x])
+                m->tiles[(y / MASK_TILE) * m->tiles_x + x / MASK_TILE] = 1;
+        }
+    }
+    fclose(fp);
+    free(row);
+    if (status != 0)
+    {
+        free(m->inside);
+        free(m->tiles);
+    }
+    return status;
+}
+
+/* Open output_file_name for writing tiles into, keeping an existing w x h result if keep is set and there is one, or
+   else creating it all black. Return: the descriptor (*payload set to the pixel offset), or -1 on error.
+ */
+static int open_masked_output(const char *output_file_name, unsigned long int w, unsigned long int h, int keep, off_t *payload)
+{
+    char header[64];
+    int header_bytes = snprintf(header, sizeof(header), "P6\n%lu %lu\n%d\n", w, h, RGB_COMPONENT_COLOR);
+    off_t size = header_bytes + (off_t)(w * h * sizeof(PPMPixel));
+    *payload = header_bytes;
+
+    int fd = open(output_file_name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Unable to open file %s for writing\n", output_file_name);
+        return -1;
+    }
+    struct stat st;
+    char existing[64];
+    if (keep && fstat(fd, &st) == 0 && st.st_size == size && pread(fd, existing, header_bytes, 0) == header_bytes &&
+        memcmp(existing, header, header_bytes) == 0)
+        return fd;
+
+    // start from black: the pixels are a hole until a tile gets written
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, header, header_bytes, 0) != header_bytes || ftruncate(fd, size) != 0)
+    {
+        fprintf(stderr, "Error: Unable to create %s\n", output_file_name);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int mask_image(struct mask_job *job)
+{
+    const struct mask *m = job->mask;
+    unsigned long int w, h;
+    off_t payload = 0, out_payload = 0;
+    int fd = open_image_rows(job->input_file_name, &w, &h, &payload);
+    if (fd < 0)
+        return -1;
+    if (w != m->width || h != m->height)
+    {
+        fprintf(stderr, "Error: %s is %lux%lu but the mask is %lux%lu\n", job->input_file_name, w, h, m->width, m->height);
+        close(fd);
+        return -1;
+    }
+    int out = open_masked_output(job->output_file_name, w, h, mask_keep_outside, &out_payload);
+    if (out < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    int radius = filter_float_kernel ? filter_float_kernel->size / 2 : filter_kernel->size / 2;
+    long window_w = w + 2 * radius, window_h = MASK_TILE + 2 * radius; // the widest run there can be
+    PPMPixel *in = (PPMPixel *)malloc(window_w * window_h * sizeof(PPMPixel));
+    PPMPixel *filtered = (PPMPixel *)malloc(window_w * MASK_TILE * sizeof(PPMPixel));
+    PPMPixel *kept = (PPMPixel *)malloc(w * sizeof(PPMPixel));
+    int status = (in && filtered && kept) ? 0 : -1;
+    if (status != 0)
+        fprintf(stderr, "Error: Unable to allocate memory for %s\n", job->output_file_name);
+
+    for (unsigned long ty = 0; status == 0 && ty < m->tiles_y; ty++)
+    {
+        long y0 = ty * MASK_TILE, rows = h - y0 < MASK_TILE ? h - y0 : MASK_TILE;
+        const unsigned char *tiles = m->tiles + ty * m->tiles_x;
+        for (unsigned long tx = 0, run_end; status == 0 && tx < m->tiles_x; tx = run_end)
+        {
+            // the next run of tiles touching the mask
+            run_end = tx + 1;
+            if (!tiles[tx])
+                continue;
+            while (run_end < m->tiles_x && tiles[run_end])
+                run_end++;
+            job->tiles_filtered += run_end - tx;
+            long x0 = tx * MASK_TILE, run_w = (run_end == m->tiles_x ? (long)w : (long)run_end * MASK_TILE) - x0;
+
+            // the run with its halo is a little image of its own, filtered on its inner rows
+            long cols = run_w + 2 * radius;
+            struct image_view window = packed_view(in, cols, rows + 2 * radius), result = packed_view(filtered, cols, rows);
+            for (long r = 0; status == 0 && r < rows + 2 * radius; r++)
+                status = pread_pixels(fd, payload, w, h, y0 - radius + r, x0 - radius, cols, in + r * cols);
+            if (status != 0)
+            {
+                fprintf(stderr, "Error: Unexpected end of file while reading pixel data in %s\n", job->input_file_name);
+                break;
+            }
+            status = filter_float_kernel ? convolve_rows_float(filter_float_kernel, &window, &result, radius, radius + rows, NULL)
+                                         : convolve_rows(filter_kernel, &window, &result, radius, radius + rows, NULL);
+            if (status != 0)
+            {
+                fprintf(stderr, "Error: Unable to allocate memory for %s\n", job->output_file_name);
+                break;
+            }
+
+            for (long r = 0; status == 0 && r < rows; r++)
+            {
+                PPMPixel *pixels = filtered + r * cols + radius;
+                const unsigned char *inside = m->inside + (y0 + r) * w + x0;
+                off_t offset = out_payload + (off_t)((y0 + r) * w + x0) * sizeof(PPMPixel);
+                size_t bytes = run_w * sizeof(PPMPixel);
+                // pixels of the run outside the mask are black, or keep what the output had there
+                if (mask_keep_outside && memchr(inside, 0, run_w) && pread(out, kept, bytes, offset) != (ssize_t)bytes)
+                    status = -1;
+                for (long x = 0; status == 0 && x < run_w; x++)
+                {
+                    if (!inside[x])
+                    {
+                        PPMPixel black = {0, 0, 0};
+                        pixels[x] = mask_keep_outside ? kept[x] : black;
+                    }
+                }
+                rate_limit_acquire(&write_limit, bytes);
+                if (status != 0 || pwrite(out, pixels, bytes, offset) != (ssize_t)bytes)
+                {
+                    fprintf(stderr, "Error: Failed to write pixel data to file %s\n", job->output_file_name);
+                    status = -1;
+                }
+            }
+        }
+    }
+
+    if (close(out) != 0)
+        status = -1;
+    close(fd);
+    free(in);
+    free(filtered);
+    free(kept);
+    return status;
+}
+
+static void *mask_threadfn(void *arg)
+{
+    struct mask_job *job = (struct mask_job *)arg;
+    job->ok = mask_image(job) == 0;
+    return NULL;
+}
+
+int run_masked(char **files, int count)
+{
+    pthread_once(&laplacian_kernel_once, prepare_laplacian_kernel);
+    struct mask mask;
+    if (load_mask(mask_file_name, &mask) != 0)
+        return 1;
+
+    struct mask_job jobs[count];
+    pthread_t threads[count];
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        memset(&jobs[i], 0, sizeof(jobs[i]));
+        jobs[i].input_file_name = files[i];
+        jobs[i].mask = &mask;
+        sprintf(jobs[i].output_file_name, "laplacian%d.ppm", i + 1);
+        if (pthread_create(&threads[i], NULL, mask_threadfn, &jobs[i]) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create mask thread %d\n", i);
+            exit(1);
+        }
+    }
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        if (!jobs[i].ok)
+        {
+            failures++;
+            continue;
+        }
+        printf("%s: filtered %lu of %lu tiles, skipped %lu -> %s\n", jobs[i].input_file_name, jobs[i].tiles_filtered,
+               mask.tile_count, mask.tile_count - jobs[i].tiles_filtered, jobs[i].output_file_name);
+    }
+    gettimeofday(&end, NULL);
+    printf("Total elapsed time: %.4f s\n", (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0);
+    free(mask.inside);
+    free(mask.tiles);
+    return failures ? 1 : 0;
+}
+
+/* Window of each image to filter (--roi=X,Y,W,H), as a view into the image read, so nothing is copied. */
+static struct
+{
+    int enabled;
+    unsigned long int x, y, w, h;
+} roi = {0, 0, 0, 0, 0};
+
+/* Multi-image files (--multi-image). Every image found by index_images is read on its own and submitted as a job of
+   its own, MULTI_IMAGES_IN_FLIGHT at a time, so the pool filters several images of the file at once while the file's
+   thread reads the next ones and writes finished ones, in order. The results go to laplacianN_K.ppm (K counting from
+   1; just laplacianN.ppm if the file holds a single image), or with concat one after the other into laplacianN.ppm,
+   a multi-image file matching the input.
+ */
+#define MULTI_IMAGES_IN_FLIGHT 4
+
+static struct
+{
+    int enabled;
+    int concat; // one output file holding every result instead of one file per image
+} multi_image = {0, 0};
+
+struct multi_slot
+{
+    long index;               // which image of the file
+    PPMPixel *image, *result;
+    size_t image_bytes, result_bytes;
+    struct image_view dst;
+    struct filter_job *job;   // NULL when the slot is free
+};
+
+/* Wait for the image in slot and write it out (to out if concatenating). Return: 0, or -1 if it couldn't be written. */
+static int finish_multi_slot(struct multi_slot *slot, const struct file_name_args *file_args, long count, FILE *out,
+                             double *elapsed_total)
+{
+    double elapsed_time;
+    int failed = filter_job_wait(slot->job, &elapsed_time);
+    slot->job = NULL;
+    *elapsed_total += elapsed_time;
+    if (failed)
+    {
+        buffer_pool_put(slot->image, slot->image_bytes);
+        buffer_pool_put(slot->result, slot->result_bytes);
+        return -1;
+    }
+
+    char name[64];
+    const char *output = file_args->output_file_name;
+    struct output_checksum checksum;
+    int status;
+    if (out)
+    {
+        snprintf(name, sizeof(name), "%s#%ld", output, slot->index + 1); // the manifest names each image in the file
+        status = write_view(out, &slot->dst, output, manifest_file ? &checksum : NULL);
+    }
+    else
+    {
+        if (count == 1)
+            snprintf(name, sizeof(name), "%s", output);
+        else
+            snprintf(name, sizeof(name), "%.*s_%ld.ppm", (int)strlen(output) - 4, output, slot->index + 1);
+        status = save_view(&slot->dst, name, manifest_file ? &checksum : NULL);
+    }
+    if (status == 0 && manifest_file)
+    {
+        append_manifest(name, slot->dst.width, slot->dst.height, &checksum, elapsed_time);
+        free(checksum.bands);
+    }
+    buffer_pool_put(slot->image, slot->image_bytes);
+    buffer_pool_put(slot->result, slot->result_bytes);
+    return status;
+}
+
+/* Filter every image of a multi-image file (see above). Exits on error, like manage_image_file. */
+static void filter_multi_image_file(const struct file_name_args *file_args)
+{
+    const char *filename = file_args->input_file_name;
+    struct ppm_entry *entries;
+    long count = index_images(filename, &entries);
+    if (count <= 0)
+        exit(1); // index_images said why
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+    {
+        fprintf(stderr, "Error: Unable to open file %s\n", filename);
+        exit(1);
+    }
+    FILE *out = NULL;
+    if (multi_image.concat && !(out = fopen(file_args->output_file_name, "wb")))
+    {
+        fprintf(stderr, "Error: Unable to open file %s for writing\n", file_args->output_file_name);
+        exit(1);
+    }
+
+    struct multi_slot slots[MULTI_IMAGES_IN_FLIGHT];
+    memset(slots, 0, sizeof(slots));
+    double elapsed_total = 0;
+    for (long k = 0; k < count + MULTI_IMAGES_IN_FLIGHT; k++)
+    {
+        struct multi_slot *slot = &slots[k % MULTI_IMAGES_IN_FLIGHT];
+        if (slot->job && finish_multi_slot(slot, file_args, count, out, &elapsed_total) != 0)
+            exit(1);
+        if (k >= count)
+            continue; // draining
+
+        const struct ppm_entry *entry = &entries[k];
+        slot->index = k;
+        slot->image_bytes = entry->width * entry->height * sizeof(PPMPixel);
+        slot->image = (PPMPixel *)buffer_pool_get(slot->image_bytes);
+        if (!slot->image)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for image data\n");
+            exit(1);
+        }
+        struct image_view src = packed_view(slot->image, entry->width, entry->height);
+        if (fseeko(fp, entry->payload, SEEK_SET) != 0 || read_pixels(fp, filename, &src) != 0)
+            exit(1);
+        if (roi.enabled && crop_view(&src, roi.x, roi.y, roi.w, roi.h, &src) != 0)
+        {
+            fprintf(stderr, "Error: --roi doesn't fit inside image %ld of %s (%lux%lu)\n", k + 1, filename, entry->width,
+                    entry->height);
+            exit(1);
+        }
+
+        slot->result_bytes = src.width * src.height * sizeof(PPMPixel);
+        slot->result = (PPMPixel *)buffer_pool_get(slot->result_bytes);
+        if (!slot->result)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for result image\n");
+            exit(1);
+        }
+        slot->dst = packed_view(slot->result, src.width, src.height);
+        if (!(slot->job = filter_view_async(NULL, &src, &slot->dst, NULL, NULL, NULL, -1)))
+            exit(1);
+    }
+
+    fclose(fp);
+    if (out && fclose(out) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write pixel data to file %s\n", file_args->output_file_name);
+        exit(1);
+    }
+    free(entries);
+    if (count > 1)
+        printf("%s: %ld images\n", filename, count);
+
+    pthread_mutex_lock(&time_mutex);
+    total_elapsed_time += elapsed_total;
+    pthread_mutex_unlock(&time_mutex);
+}
+
+/* Small-image batching (--batch-small[=PIXELS]). A prescan reads just the header of every input; images of at most
+   PIXELS pixels that share their size with at least one other input are grouped and filtered BATCH_IMAGES at a time
+   by convolve_batch, on LAPLACIAN_THREADS threads, before the other images go through the usual thread per file.
+   Outputs keep their names (laplacianN.ppm for the Nth file) whichever way they were made.
+ */
+#define BATCH_IMAGES 16 // images per convolve_batch call: 48 bytes from one pixel to the next
+
+struct small_image
+{
+    int index; // position on the command line
+    unsigned long int width, height;
+};
+
+struct small_batch
+{
+    const struct small_image *images; // BATCH_IMAGES or fewer, all the same size
+    int count;
+};
+
+static unsigned long batch_small_pixels = 0; // largest image --batch-small groups, 0 when off
+
+static struct
+{
+    char **files;
+    struct small_batch *batches;
+    int batch_count;
+    int next;   // next batch to take (atomic)
+    int failed;
+} batch_work;
+
+static int compare_small_images(const void *a, const void *b)
+{
+    const struct small_image *x = (const struct small_image *)a, *y = (const struct small_image *)b;
+    if (x->width != y->width)
+        return x->width < y->width ? -1 : 1;
+    if (x->height != y->height)
+        return x->height < y->height ? -1 : 1;
+    return x->index - y->index;
+}
+
+/* Read, filter and write one batch. Return: 0, or -1 (after printing why) on error. */
+static int filter_small_batch(const struct small_batch *batch)
+{
+    unsigned long int w = batch->images[0].width, h = batch->images[0].height;
+    size_t bytes = w * h * sizeof(PPMPixel);
+    PPMPixel *images[BATCH_IMAGES] = {NULL}, *results[BATCH_IMAGES] = {NULL};
+    int status = 0;
+    for (int i = 0; status == 0 && i < batch->count; i++)
+    {
+        unsigned long int width, height;
+        images[i] = load_image(batch_work.files[batch->images[i].index], &width, &height);
+        results[i] = (PPMPixel *)buffer_pool_get(bytes);
+        if (!images[i] || width != w || height != h)
+            status = -1; // load_image said why, or the file changed since the prescan
+        else if (!results[i])
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for result image\n");
+            status = -1;
+        }
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    if (status == 0 && convolve_batch(filter_kernel, images, results, batch->count, w, h) != 0)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for a batch of %lux%lu images\n", w, h);
+        status = -1;
+    }
+    gettimeofday(&end, NULL);
+    double elapsed_time = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    for (int i = 0; status == 0 && i < batch->count; i++)
+    {
+        char output_file_name[32];
+        struct output_checksum checksum;
+        snprintf(output_file_name, sizeof(output_file_name), "laplacian%d.ppm", batch->images[i].index + 1);
+        if (save_image(results[i], output_file_name, w, h, manifest_file ? &checksum : NULL) != 0)
+            status = -1;
+        else if (manifest_file)
+        {
+            append_manifest(output_file_name, w, h, &checksum, elapsed_time / batch->count);
+            free(checksum.bands);
+        }
+    }
+    for (int i = 0; i < batch->count; i++)
+    {
+        if (images[i])
+            buffer_pool_put(images[i], bytes);
+        if (results[i])
+            buffer_pool_put(results[i], bytes);
+    }
+
+    pthread_mutex_lock(&time_mutex);
+    total_elapsed_time += elapsed_time;
+    pthread_mutex_unlock(&time_mutex);
+    return status;
+}
+
+static void *small_batch_threadfn(void *unused)
+{
+    (void)unused;
+    int b;
+    while ((b = __atomic_fetch_add(&batch_work.next, 1, __ATOMIC_RELAXED)) < batch_work.batch_count)
+    {
+        if (filter_small_batch(&batch_work.batches[b]) != 0)
+            __atomic_store_n(&batch_work.failed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* Prescan the count files and filter the small ones that can be batched, setting done[i] for each of them.
+   Return: 0, or -1 (after printing why) if a header couldn't be read or a batch failed.
+ */
+int filter_small_images(char **files, int count, char *done)
+{
+    pthread_once(&laplacian_kernel_once, prepare_laplacian_kernel);
+    struct small_image *small = (struct small_image *)malloc((count ? count : 1) * sizeof(struct small_image));
+    struct small_batch *batches = (struct small_batch *)malloc((count ? count : 1) * sizeof(struct small_batch));
+    if (!small || !batches)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for the prescan\n");
+        free(small);
+        free(batches);
+        return -1;
+    }
+
+    // prescan: just the headers
+    int small_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        FILE *fp = fopen(files[i], "rb");
+        unsigned long int w, h;
+        if (!fp)
+        {
+            fprintf(stderr, "Error: Unable to open file %s\n", files[i]);
+            free(small);
+            free(batches);
+            return -1;
+        }
+        int status = read_header(fp, files[i], &w, &h);
+        fclose(fp);
+        if (status != 0)
+        {
+            free(small);
+            free(batches);
+            return -1;
+        }
+        if (w * h <= batch_small_pixels)
+        {
+            struct small_image image = {i, w, h};
+            small[small_count++] = image;
+        }
+    }
+
+    // group by size, then cut every group of two or more into batches
+    qsort(small, small_count, sizeof(struct small_image), compare_small_images);
+    int batch_count = 0;
+    for (int first = 0, last; first < small_count; first = last)
+    {
+        for (last = first + 1;
+             last < small_count && small[last].width == small[first].width && small[last].height == small[first].height; last++)
+            ;
+        if (last - first < 2)
+            continue;
+        for (int i = first; i < last; i += BATCH_IMAGES)
+        {
+            batches[batch_count].images = &small[i];
+            batches[batch_count].count = last - i < BATCH_IMAGES ? last - i : BATCH_IMAGES;
+            batch_count++;
+            for (int j = i; j < i + batches[batch_count - 1].count; j++)
+                done[small[j].index] = 1;
+        }
+    }
+
+    batch_work.files = files;
+    batch_work.batches = batches;
+    batch_work.batch_count = batch_count;
+    batch_work.next = 0;
+    batch_work.failed = 0;
+    int threads = batch_count < LAPLACIAN_THREADS ? batch_count : LAPLACIAN_THREADS;
+    pthread_t workers[LAPLACIAN_THREADS];
+    for (int t = 0; t < threads; t++)
+    {
+        if (pthread_create(&workers[t], NULL, small_batch_threadfn, NULL) != 0)
+        {
+            small_batch_threadfn(NULL); // do the rest here
+            threads = t;
+            break;
+        }
+    }
+    for (int t = 0; t < threads; t++)
+        pthread_join(workers[t], NULL);
+
+    free(small);
+    free(batches);
+    return batch_work.failed ? -1 : 0;
+}
+
+/* The thread function that manages an image file.
+ Read an image file that is passed as an argument at runtime.
+ Apply the Laplacian filter.
+ Update the value of total_elapsed_time.
+ Save the result image in a file called laplaciani.ppm, where i is the image file order in the passed arguments.
+ Example: the result image of the file passed third during the input shall be called "laplacian3.ppm".
+*/
+void *manage_image_file(void *args)
+{
+    struct file_name_args *file_args = (struct file_name_args *)args;
+
+    admit_image();
+    if (multi_image.enabled)
+    {
+        filter_multi_image_file(file_args);
+        free(file_args);
+        release_image();
+        return NULL;
+    }
+    unsigned long int width, height;
+    struct image_view src, dst;
+    void *image;
+    if (bayer_input.enabled)
+    {
+        // raw sensor data: demosaiced on the fly by the filter
+        if (!(image = load_bayer(file_args->input_file_name, &src)))
+            exit(1);
+        width = src.width;
+        height = src.height;
+    }
+    else
+    {
+        image = read_image(file_args->input_file_name, &width, &height);
+        src = packed_view((PPMPixel *)image, width, height);
+    }
+    size_t image_bytes = src.height * src.stride;
+
+    // with --roi only that window of the image is filtered (as an image of its own) and written
+    if (roi.enabled && crop_view(&src, roi.x, roi.y, roi.w, roi.h, &src) != 0)
+    {
+        fprintf(stderr, "Error: --roi doesn't fit inside %s (%lux%lu%s)\n", file_args->input_file_name, width, height,
+                bayer_input.enabled ? ", and must be even for Bayer input" : "");
+        exit(1);
+    }
+
+    struct hough_votes votes;
+    if (hough_top_k && hough_init(&votes, src.width, src.height) != 0)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for Hough votes\n");
+        exit(1);
+    }
+
+    double elapsed_time;
+    struct output_checksum checksum;
+    PPMPixel *result = NULL;
+    if (mmap_output.enabled)
+    {
+        // filter straight into the output file
+        struct mapped_image output;
+        if (!map_output_image(file_args->output_file_name, src.width, src.height, &output) ||
+            filter_view(&src, &output.pixels, hough_top_k ? &votes : NULL, &elapsed_time) != 0 ||
+            finish_output_image(&output, file_args->output_file_name, src.width, src.height, manifest_file ? &checksum : NULL) != 0)
+            exit(1);
+    }
+    else
+    {
+        result = (PPMPixel *)buffer_pool_get(src.width * src.height * sizeof(PPMPixel));
+        if (!result)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for result image\n");
+            exit(1);
+        }
+        dst = packed_view(result, src.width, src.height);
+        if (filter_view(&src, &dst, hough_top_k ? &votes : NULL, &elapsed_time) != 0 ||
+            save_view(&dst, file_args->output_file_name, manifest_file ? &checksum : NULL) != 0)
+            exit(1);
+    }
+    if (manifest_file)
+    {
+        append_manifest(file_args->output_file_name, src.width, src.height, &checksum, elapsed_time);
+        free(checksum.bands);
+    }
+    if (hough_top_k)
+    {
+        hough_merge(&votes);
+        if (print_hough_lines(file_args->input_file_name, &votes) != 0)
+            exit(1);
+        hough_free(&votes);
+    }
+
+    // Protect total_elapsed_time update with a mutex
+    pthread_mutex_lock(&time_mutex);
+    total_elapsed_time += elapsed_time;
+    pthread_mutex_unlock(&time_mutex);
+
+    buffer_pool_put(image, image_bytes);
+    if (result)
+        buffer_pool_put(result, src.width * src.height * sizeof(PPMPixel));
+    free(file_args);
+    release_image();
+
+    return NULL;
+}
+
+static struct mpmc_queue async_completed; // images whose job has finished, in completion order
+
+/* Job callback of --async: hand the image over to the main thread. */
+static void async_job_done(struct filter_job *job, void *user_data)
+{
+    (void)job;
+    mpmc_push(&async_completed, user_data);
+}
+
+/* --async: the main thread reads every image and submits it to the pool right away, then takes the images off
+ the completion queue as their jobs finish and writes them out. No thread is created per image.
+ Return: 0 on success, 1 on error.
+ */
+int run_async(char **files, int count)
+{
+    struct async_image
+    {
+        PPMPixel *image, *result;
+        unsigned long int width, height;
+        struct filter_job *job;
+        struct mapped_image output; // with --mmap-output, result points into it
+        char output_file_name[20];
+    };
+
+    // finished jobs come back through a queue with room for all of them, so the callback never blocks
+    struct async_image *images = (struct async_image *)calloc(count, sizeof(struct async_image));
+    if (!images || mpmc_init(&async_completed, count) != 0)
+    {
+        fprintf(stderr, "Error: Unable to set up asynchronous jobs\n");
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        struct async_image *img = &images[i];
+        sprintf(img->output_file_name, "laplacian%d.ppm", i + 1);
+        img->image = read_image(files[i], &img->width, &img->height);
+        if (mmap_output.enabled)
+            img->result = map_output_image(img->output_file_name, img->width, img->height, &img->output);
+        else
+            img->result = (PPMPixel *)malloc(img->width * img->height * sizeof(PPMPixel));
+        if (!img->result ||
+            !(img->job = apply_filters_async(img->image, img->result, img->width, img->height, async_job_done, img, -1)))
+        {
+            fprintf(stderr, "Error: Unable to submit %s\n", files[i]);
+            exit(1);
+        }
+    }
+
+    for (int pending = count; pending > 0; pending--)
+    {
+        struct async_image *img = (struct async_image *)mpmc_pop(&async_completed);
+
+        double elapsed_time;
+        if (filter_job_wait(img->job, &elapsed_time) != 0)
+        {
+            fprintf(stderr, "Error: Filtering %s failed\n", img->output_file_name);
+            exit(1);
+        }
+        img->job = NULL;
+        total_elapsed_time += elapsed_time;
+        struct output_checksum checksum;
+        if (mmap_output.enabled)
+        {
+            if (finish_output_image(&img->output, img->output_file_name, img->width, img->height, manifest_file ? &checksum : NULL) != 0)
+                exit(1);
+        }
+        else
+        {
+            write_image(img->result, img->output_file_name, img->width, img->height, manifest_file ? &checksum : NULL);
+            buffer_pool_put(img->result, img->width * img->height * sizeof(PPMPixel));
+        }
+        if (manifest_file)
+        {
+            append_manifest(img->output_file_name, img->width, img->height, &checksum, elapsed_time);
+            free(checksum.bands);
+        }
+        buffer_pool_put(img->image, img->width * img->height * sizeof(PPMPixel));
+    }
+
+    mpmc_destroy(&async_completed);
+    free(images);
+    printf("Total elapsed time: %.4f s\n", total_elapsed_time);
+    return 0;
+}
+
+/* Result cache for daemon mode (--cache=MB). Filtered images are kept in memory, least recently used first out once
+ the cache holds more than its byte budget, so a repeated request is answered by writing the cached result without
+ rereading or refiltering the input. Entries are keyed by path, device, inode, size and modification time of the
+ input plus a hash of the filter options, so a changed file or different filter never hits a stale result.
+ */
+struct cache_entry
+{
+    char *path;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    uint64_t options;          // filter_options_hash() when the result was made
+    PPMPixel *result;
+    unsigned long int width, height;
+    int refs;                  // requests currently writing this entry out, plus one while it is in the cache
+    struct cache_entry *prev, *next;
+};
+
+static struct
+{
+    size_t limit;              // byte budget, 0 disables the cache
+    size_t bytes;
+    unsigned long entries, hits, misses, evictions;
+    struct cache_entry *head, *tail; // most recently used first
+    pthread_mutex_t lock;
+} result_cache = {256UL << 20, 0, 0, 0, 0, 0, NULL, NULL, PTHREAD_MUTEX_INITIALIZER};
+
+/* Hash of everything that changes what a filtered image looks like. */
+static uint64_t filter_options_hash(void)
+{
+    uint64_t h = checksum_bytes(filter_kernel->coef, sizeof(filter_kernel->coef), filter_kernel->size);
+    if (filter_float_kernel)
+        h = checksum_bytes(filter_float_kernel->coef, sizeof(filter_float_kernel->coef), h ^ filter_float_kernel->size);
+    if (filter_pipeline)
+        h = checksum_bytes(filter_pipeline->ops, filter_pipeline->count * sizeof(struct pipeline_op), h ^ 0x5049504cULL);
+    return h;
+}
+
+static void cache_entry_unref(struct cache_entry *entry)
+{
+    if (--entry->refs > 0)
+        return;
+    free(entry->path);
+    free(entry->result);
+    free(entry);
+}
+
+static void cache_unlink(struct cache_entry *entry)
+{
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        result_cache.head = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        result_cache.tail = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+static void cache_push_front(struct cache_entry *entry)
+{
+    entry->next = result_cache.head;
+    if (result_cache.head)
+        result_cache.head->prev = entry;
+    result_cache.head = entry;
+    if (!result_cache.tail)
+        result_cache.tail = entry;
+}
+
+/* Look up the result for an input with the given stat. Return: the entry with a reference taken (drop it with
+ cache_release), or NULL on a miss.
+ */
+/* Return: the entry for the key, or NULL. Called with the cache lock held. */
+static struct cache_entry *cache_find(const char *path, const struct stat *st, uint64_t options)
+{
+    struct cache_entry *entry = result_cache.head;
+    for (; entry; entry = entry->next)
+    {
+        if (entry->inode == st->st_ino && entry->device == st->st_dev && entry->size == st->st_size &&
+            entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec &&
+            entry->options == options && strcmp(entry->path, path) == 0)
+            break;
+    }
+    return entry;
+}
+
+struct cache_entry *cache_lookup(const char *path, const struct stat *st, uint64_t options)
+{
+    pthread_mutex_lock(&result_cache.lock);
+    struct cache_entry *entry = cache_find(path, st, options);
+    if (entry)
+    {
+        cache_unlink(entry);
+        cache_push_front(entry);
+        entry->refs++;
+        result_cache.hits++;
+    }
+    else
+    {
+        result_cache.misses++;
+    }
+    pthread_mutex_unlock(&result_cache.lock);
+    return entry;
+}
+
+void cache_release(struct cache_entry *entry)
+{
+    pthread_mutex_lock(&result_cache.lock);
+    cache_entry_unref(entry);
+    pthread_mutex_unlock(&result_cache.lock);
+}
+
+/* Hand a freshly filtered result over to the cache, evicting least recently used entries to stay within the budget.
+ The cache owns result afterwards (it is freed right away if it can't be cached, or if a request that missed at the
+ same time already cached it).
+ */
+void cache_insert(const char *path, const struct stat *st, uint64_t options, PPMPixel *result, unsigned long int width, unsigned long int height)
+{
+    size_t bytes = width * height * sizeof(PPMPixel);
+    struct cache_entry *entry = (struct cache_entry *)calloc(1, sizeof(struct cache_entry));
+    if (!entry || bytes > result_cache.limit || !(entry->path = strdup(path)))
+    {
+        free(entry);
+        free(result);
+        return;
+    }
+    entry->device = st->st_dev;
+    entry->inode = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+    entry->options = options;
+    entry->result = result;
+    entry->width = width;
+    entry->height = height;
+    entry->refs = 1;
+
+    pthread_mutex_lock(&result_cache.lock);
+    if (cache_find(path, st, options))
+    {
+        pthread_mutex_unlock(&result_cache.lock);
+        free(entry->path);
+        free(entry);
+        free(result);
+        return;
+    }
+    while (result_cache.tail && result_cache.bytes + bytes > result_cache.limit)
+    {
+        struct cache_entry *victim = result_cache.tail;
+        cache_unlink(victim);
+        result_cache.bytes -= victim->width * victim->height * sizeof(PPMPixel);
+        result_cache.entries--;
+        result_cache.evictions++;
+        cache_entry_unref(victim);
+    }
+    cache_push_front(entry);
+    result_cache.bytes += bytes;
+    result_cache.entries++;
+    pthread_mutex_unlock(&result_cache.lock);
+}
+
+/* Daemon mode (--daemon=SOCKET). Serves requests on a Unix stream socket, one thread per connection, all sharing the
+ worker pool. Each request is one line and gets one reply:
+     FILTER <input> <output>   -> OK <output> <width> <height> <seconds> [cached], or ERR <reason>
+     CLIENT <name> [weight]    -> OK (the connection's requests count as name's, sharing the pool by weight)
+     RATE read|write <MB/s>    -> OK (changes the bandwidth limit for everyone, 0 removes it)
+     STATS                     -> one "<name> <value>" line per metric and one "client ..." line per client, then OK
+     QUIT                      -> closes the connection
+ */
+static struct
+{
+    unsigned long requests;  // FILTER requests served
+    unsigned long failures;  // FILTER requests that failed
+    pthread_mutex_t lock;
+} daemon_stats = {0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+/* Write out a result for a daemon client and format the reply line. Return: 0 on success, -1 on failure. */
+static int daemon_write_result(PPMPixel *result, const char *output, unsigned long int width, unsigned long int height,
+                               double elapsed_time, int cached, char *reply, size_t reply_size)
+{
+    struct output_checksum checksum;
+    if (save_image(result, output, width, height, manifest_file ? &checksum : NULL) != 0)
+    {
+        snprintf(reply, reply_size, "ERR cannot write %s\n", output);
+        return -1;
+    }
+    if (manifest_file)
+    {
+        append_manifest(output, width, height, &checksum, elapsed_time);
+        free(checksum.bands);
+    }
+    snprintf(reply, reply_size, "OK %s %lu %lu %.4f%s\n", output, width, height, elapsed_time, cached ? " cached" : "");
+    return 0;
+}
+
+/* Filter one image for a daemon client (or take it from the result cache) and format the reply line.
+ Return: 0 on success (with the image size in *width and *height), -1 on failure.
+ */
+static int daemon_filter(struct client_queue *client, const char *input, const char *output, char *reply, size_t reply_size,
+                         unsigned long int *width, unsigned long int *height)
+{
+    // the key comes from the file that is read, so a file replaced in between can't be cached under the old one's key
+    struct stat st;
+    uint64_t options = filter_options_hash();
+    FILE *fp = fopen(input, "rb");
+    if (!fp)
+        fprintf(stderr, "Error: Unable to open file %s\n", input);
+    int cacheable = fp && result_cache.limit > 0 && fstat(fileno(fp), &st) == 0;
+    if (cacheable)
+    {
+        struct cache_entry *entry = cache_lookup(input, &st, options);
+        if (entry)
+        {
+            fclose(fp);
+            *width = entry->width;
+            *height = entry->height;
+            int status = daemon_write_result(entry->result, output, entry->width, entry->height, 0, 1, reply, reply_size);
+            cache_release(entry);
+            return status;
+        }
+    }
+
+    PPMPixel *image = fp ? load_image_file(fp, input, width, height) : NULL;
+    if (fp)
+        fclose(fp);
+    if (!image)
+    {
+        snprintf(reply, reply_size, "ERR cannot read %s\n", input);
+        return -1;
+    }
+
+    size_t bytes = *width * *height * sizeof(PPMPixel);
+    PPMPixel *result = (PPMPixel *)buffer_pool_get(bytes);
+    struct filter_job *job = result ? apply_filters_async_for(client, image, result, *width, *height, NULL, NULL, -1) : NULL;
+    if (!job)
+    {
+        snprintf(reply, reply_size, "ERR cannot filter %s\n", input);
+        buffer_pool_put(image, bytes);
+        free(result);
+        return -1;
+    }
+    double elapsed_time;
+    int failed = filter_job_wait(job, &elapsed_time);
+    buffer_pool_put(image, bytes);
+    if (failed)
+    {
+        snprintf(reply, reply_size, "ERR cannot filter %s\n", input);
+        buffer_pool_put(result, bytes);
+        return -1;
+    }
+
+    int status = daemon_write_result(result, output, *width, *height, elapsed_time, 0, reply, reply_size);
+    if (status == 0 && cacheable)
+        cache_insert(input, &st, options, result, *width, *height);
+    else
+        buffer_pool_put(result, bytes);
+    return status;
+}
+
+/* Account a request served to its client (a width x height image). */
+static void daemon_record_request(struct client_queue *client, const struct timeval *received, unsigned long int width,
+                                  unsigned long int height)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    double latency = (now.tv_sec - received->tv_sec) + (now.tv_usec - received->tv_usec) / 1000000.0;
+
+    pthread_mutex_lock(&pool.lock);
+    client->images++;
+    client->pixels += (double)width * height;
+    client->latency_total += latency;
+    if (latency > client->latency_max)
+        client->latency_max = latency;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Print the daemon metrics to fd, one "<name> <value>" line each. */
+static void daemon_write_stats(int fd)
+{
+    pthread_mutex_lock(&daemon_stats.lock);
+    dprintf(fd, "requests %lu\nfailures %lu\n", daemon_stats.requests, daemon_stats.failures);
+    pthread_mutex_unlock(&daemon_stats.lock);
+    dprintf(fd, "bytes_read %llu\nbytes_written %llu\nread_limit_mbps %.3f\nwrite_limit_mbps %.3f\n",
+            read_limit.total, write_limit.total, read_limit.rate / 1e6, write_limit.rate / 1e6);
+    pthread_mutex_lock(&result_cache.lock);
+    dprintf(fd, "cache_hits %lu\ncache_misses %lu\ncache_evictions %lu\ncache_entries %lu\ncache_bytes %zu\ncache_limit_bytes %zu\n",
+            result_cache.hits, result_cache.misses, result_cache.evictions, result_cache.entries, result_cache.bytes,
+            result_cache.limit);
+    pthread_mutex_unlock(&result_cache.lock);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&pool.lock);
+    for (struct client_queue *client = pool.clients; client; client = client->next)
+    {
+        double seconds = (now.tv_sec - client->first_seen.tv_sec) + (now.tv_usec - client->first_seen.tv_usec) / 1000000.0;
+        dprintf(fd, "client %s weight %.2f images %lu mpix_per_s %.2f avg_latency_ms %.3f max_latency_ms %.3f\n",
+                client->name, client->weight, client->images, seconds > 0 ? client->pixels / seconds / 1e6 : 0.0,
+                client->images ? client->latency_total / client->images * 1000 : 0.0, client->latency_max * 1000);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void *daemon_client_threadfn(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    FILE *in = fdopen(fd, "r");
+    if (!in)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    struct client_queue *client = &default_client;
+
+    char line[2200];
+    while (fgets(line, sizeof(line), in))
+    {
+        char command[16], first[1024], second[1024];
+        char reply[1200];
+        int fields = sscanf(line, "%15s %1023s %1023s", command, first, second);
+        if (fields < 1)
+            continue;
+
+        if (strcmp(command, "FILTER") == 0 && fields == 3)
+        {
+            struct timeval received;
+            unsigned long int width, height;
+            gettimeofday(&received, NULL);
+            int status = daemon_filter(client, first, second, reply, sizeof(reply), &width, &height);
+            if (status == 0)
+                daemon_record_request(client, &received, width, height);
+            pthread_mutex_lock(&daemon_stats.lock);
+            daemon_stats.requests++;
+            if (status != 0)
+                daemon_stats.failures++;
+            pthread_mutex_unlock(&daemon_stats.lock);
+        }
+        else if (strcmp(command, "CLIENT") == 0 && fields >= 2)
+        {
+            struct client_queue *named = pool_client(first, fields == 3 ? atof(second) : 0);
+            if (named)
+                client = named;
+            snprintf(reply, sizeof(reply), named ? "OK\n" : "ERR cannot add client\n");
+        }
+        else if (strcmp(command, "RATE") == 0 && fields == 3 && (strcmp(first, "read") == 0 || strcmp(first, "write") == 0))
+        {
+            rate_limit_set(first[0] == 'r' ? &read_limit : &write_limit, atof(second) * 1e6);
+            snprintf(reply, sizeof(reply), "OK\n");
+        }
+        else if (strcmp(command, "STATS") == 0)
+        {
+            daemon_write_stats(fd);
+            snprintf(reply, sizeof(reply), "OK\n");
+        }
+        else if (strcmp(command, "QUIT") == 0)
+        {
+            break;
+        }
+        else
+        {
+            snprintf(reply, sizeof(reply), "ERR unknown request\n");
+        }
+
+        if (write(fd, reply, strlen(reply)) < 0)
+            break;
+    }
+
+    fclose(in);
+    return NULL;
+}
+
+/* Listen on the Unix socket socket_path and serve clients until killed. Return: 1 if the socket can't be set up. */
+int run_daemon(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Error: Socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(server, 64) != 0)
+    {
+        fprintf(stderr, "Error: Unable to listen on %s\n", socket_path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // a client hanging up mid-reply must not kill the daemon
+    gettimeofday(&default_client.first_seen, NULL); // before any connection thread reads it
+
+    while (1)
+    {
+        int client = accept(server, NULL, NULL);
+        if (client < 0)
+            continue;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, daemon_client_threadfn, (void *)(intptr_t)client) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create thread for client\n");
+            close(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return 0;
+}
 
-    // Protect total_elapsed_time update with a mutex
-    pthread_mutex_lock(&time_mutex);
-    total_elapsed_time += elapsed_time;
-    pthread_mutex_unlock(&time_mutex);
+/* Read the first line of a sysfs/procfs file into buffer, without the newline. Return: buffer, or "n/a" if unreadable. */
+static const char *read_line_file(const char *path, char *buffer, size_t size)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp || !fgets(buffer, (int)size, fp))
+    {
+        if (fp)
+            fclose(fp);
+        snprintf(buffer, size, "n/a");
+        return buffer;
+    }
+    fclose(fp);
+    buffer[strcspn(buffer, "\n")] = '\0';
+    return buffer;
+}
 
-    free(image);
-    free(result);
-    free(file_args);
+/* Value of the first "key : value" line in /proc/cpuinfo for key. */
+static const char *cpuinfo_value(const char *key, char *buffer, size_t size)
+{
+    snprintf(buffer, size, "n/a");
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if (!fp)
+        return buffer;
+    char line[512];
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *colon = strchr(line, ':');
+        if (colon && strncmp(line, key, strlen(key)) == 0 && (line[strlen(key)] == '\t' || line[strlen(key)] == ' '))
+        {
+            snprintf(buffer, size, "%s", colon + 2 <= line + strlen(line) ? colon + 2 : "");
+            buffer[strcspn(buffer, "\n")] = '\0';
+            break;
+        }
+    }
+    fclose(fp);
+    return buffer;
+}
+
+/* Print the conditions the benchmark ran under and warn about the ones known to make timings noisy:
+ a frequency governor other than performance, and turbo boost (whose clocks depend on temperature and load).
+ */
+static void print_bench_environment(void)
+{
+    char a[256], b[256], c[256], governor[64];
+    struct utsname uts;
+
+    printf("CPU: %s (microcode %s), %ld online CPUs\n", cpuinfo_value("model name", a, sizeof(a)),
+           cpuinfo_value("microcode", b, sizeof(b)), sysconf(_SC_NPROCESSORS_ONLN));
+    read_line_file("/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor", governor, sizeof(governor));
+    printf("Frequency: governor %s, cur %s kHz", governor,
+           read_line_file("/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq", a, sizeof(a)));
+    printf(", min %s kHz", read_line_file("/sys/devices/system/cpu/cpu0/cpufreq/scaling_min_freq", a, sizeof(a)));
+    printf(", max %s kHz\n", read_line_file("/sys/devices/system/cpu/cpu0/cpufreq/scaling_max_freq", a, sizeof(a)));
+
+    // intel_pstate reports no_turbo, acpi-cpufreq reports boost
+    int turbo = -1;
+    if (strcmp(read_line_file("/sys/devices/system/cpu/intel_pstate/no_turbo", a, sizeof(a)), "n/a") != 0)
+        turbo = atoi(a) == 0;
+    else if (strcmp(read_line_file("/sys/devices/system/cpu/cpufreq/boost", a, sizeof(a)), "n/a") != 0)
+        turbo = atoi(a) != 0;
+    printf("Turbo: %s, SMT: %s (%s)\n", turbo < 0 ? "n/a" : (turbo ? "on" : "off"),
+           read_line_file("/sys/devices/system/cpu/smt/active", a, sizeof(a)),
+           read_line_file("/sys/devices/system/cpu/smt/control", b, sizeof(b)));
+
+    if (uname(&uts) == 0)
+        printf("Kernel: %s %s %s\n", uts.sysname, uts.release, uts.machine);
+    printf("THP: %s\n", read_line_file("/sys/kernel/mm/transparent_hugepage/enabled", a, sizeof(a)));
+
+    printf("Caches:");
+    for (int i = 0; i < 8; i++)
+    {
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        if (strcmp(read_line_file(path, a, sizeof(a)), "n/a") == 0)
+            break;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        read_line_file(path, b, sizeof(b));
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        printf("%s L%s %s %s", i ? "," : "", a, b, read_line_file(path, c, sizeof(c)));
+    }
+    printf("\n");
+
+    if (strcmp(governor, "n/a") != 0 && strcmp(governor, "performance") != 0)
+        fprintf(stderr, "Warning: CPU frequency governor is '%s', not 'performance'; timings will vary with frequency scaling\n", governor);
+    if (turbo == 1)
+        fprintf(stderr, "Warning: turbo boost is on; clock speed (and timings) will depend on temperature and load\n");
+}
+
+/* Benchmark mode (--bench). Filters every image REPS times (after one warm-up run) with each kernel path and prints
+ the fastest and median time per variant, after a description of the machine (print_bench_environment).
+ The integer variants use the --kernel kernel (the laplacian by default), the float ones the --float-kernel kernel
+ (log:1.0 by default). Variants the CPU can't run are skipped.
+ */
+struct bench_variant
+{
+    const char *name;
+    int simd;            // simd_enabled during the run
+    int use_float;       // run the float kernel instead of the integer one
+    enum float_isa isa;  // float_isa during the run
+    int feature;         // CPU feature the variant needs, see bench_cpu_has
+};
+
+static const struct bench_variant bench_variants[] = {
+    {"int-scalar", 0, 0, FLOAT_ISA_AUTO, 0},
+    {"int-simd", 1, 0, FLOAT_ISA_AUTO, 1},
+    {"float-scalar", 1, 1, FLOAT_ISA_SCALAR, 0},
+    {"float-avx2-fma", 1, 1, FLOAT_ISA_AVX2, 2},
+    {"float-avx512", 1, 1, FLOAT_ISA_AVX512, 3},
+};
+
+/* Return: 1 if the CPU has feature (0 none, 1 SSSE3, 2 AVX2 and FMA, 3 AVX-512F). */
+static int bench_cpu_has(int feature)
+{
+#ifdef HAVE_X86_SIMD
+    switch (feature)
+    {
+    case 1:
+        return __builtin_cpu_supports("ssse3");
+    case 2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case 3:
+        return __builtin_cpu_supports("avx512f");
+    }
+#endif
+    return feature == 0;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int bench_interleave = 0;       // --bench-interleave
+const char *bench_affinity = NULL; // --bench-affinity CPU list
+
+/* Pin the calling thread (and so the pool threads it starts later) to a comma separated list of CPUs.
+ Return: 0 on success, -1 (after printing why) otherwise.
+ */
+static int set_bench_affinity(const char *list)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%s", list);
+    for (char *tok = strtok(buffer, ","); tok; tok = strtok(NULL, ","))
+    {
+        int cpu = atoi(tok);
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+        {
+            fprintf(stderr, "Error: Invalid CPU %s in --bench-affinity\n", tok);
+            return -1;
+        }
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        fprintf(stderr, "Error: Unable to pin the benchmark to CPUs %s\n", list);
+        return -1;
+    }
+    return 0;
+}
+
+/* Filter image once with variant and return how long it took. */
+static double bench_run_once(const struct bench_variant *variant, const struct float_kernel *float_kernel,
+                             PPMPixel *image, PPMPixel *result, unsigned long int width, unsigned long int height)
+{
+    simd_enabled = variant->simd;
+    float_isa = variant->isa;
+    filter_float_kernel = variant->use_float ? float_kernel : NULL;
+
+    double elapsed_time;
+    struct filter_job *job = apply_filters_async(image, result, width, height, NULL, NULL, -1);
+    if (!job || filter_job_wait(job, &elapsed_time) != 0)
+        exit(1);
+    return elapsed_time;
+}
+
+int run_bench(char **files, int count, int reps)
+{
+    static struct float_kernel default_float_kernel;
+    const struct float_kernel *float_kernel = filter_float_kernel;
+    if (!float_kernel)
+    {
+        parse_float_kernel("log:1.0", &default_float_kernel);
+        float_kernel = &default_float_kernel;
+    }
+    if (bench_affinity && set_bench_affinity(bench_affinity) != 0)
+        return 1;
+
+    int saved_simd = simd_enabled;
+    enum float_isa saved_isa = float_isa;
+    int variant_count = sizeof(bench_variants) / sizeof(bench_variants[0]);
+    double *times = (double *)malloc(variant_count * reps * sizeof(double));
+    if (!times)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for benchmark\n");
+        return 1;
+    }
+
+    print_bench_environment();
+    printf("Benchmark: %d repetitions per variant (%s), %d tiles per image, affinity %s\n", reps,
+           bench_interleave ? "interleaved" : "back to back", filter_parallelism, bench_affinity ? bench_affinity : "none");
+    printf("%-28s %-16s %10s %10s %10s\n", "image", "variant", "min ms", "median ms", "Mpix/s");
+    for (int f = 0; f < count; f++)
+    {
+        unsigned long int width, height;
+        PPMPixel *image = read_image(files[f], &width, &height);
+        PPMPixel *result = (PPMPixel *)buffer_pool_get(width * height * sizeof(PPMPixel));
+        if (!result)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for result image\n");
+            exit(1);
+        }
+        const char *name = strrchr(files[f], '/') ? strrchr(files[f], '/') + 1 : files[f];
+
+        // one warm-up run per variant, then either all repetitions of a variant back to back, or round-robin over
+        // the variants so slow drifts (thermals, frequency, neighbours) hit every variant alike
+        for (int v = 0; v < variant_count; v++)
+        {
+            if (bench_cpu_has(bench_variants[v].feature))
+                bench_run_once(&bench_variants[v], float_kernel, image, result, width, height);
+        }
+        for (int outer = 0; outer < (bench_interleave ? reps : variant_count); outer++)
+        {
+            for (int inner = 0; inner < (bench_interleave ? variant_count : reps); inner++)
+            {
+                int v = bench_interleave ? inner : outer, r = bench_interleave ? outer : inner;
+                if (bench_cpu_has(bench_variants[v].feature))
+                    times[v * reps + r] = bench_run_once(&bench_variants[v], float_kernel, image, result, width, height);
+            }
+        }
+
+        for (int v = 0; v < variant_count; v++)
+        {
+            if (!bench_cpu_has(bench_variants[v].feature))
+                continue;
+            double *variant_times = times + v * reps;
+            qsort(variant_times, reps, sizeof(double), compare_doubles);
+            printf("%-28s %-16s %10.3f %10.3f %10.1f\n", name, bench_variants[v].name, variant_times[0] * 1000,
+                   variant_times[reps / 2] * 1000, width * height / variant_times[0] / 1e6);
+        }
+
+        buffer_pool_put(image, width * height * sizeof(PPMPixel));
+        buffer_pool_put(result, width * height * sizeof(PPMPixel));
+    }
+
+    simd_enabled = saved_simd;
+    float_isa = saved_isa;
+    filter_float_kernel = float_kernel == &default_float_kernel ? NULL : float_kernel;
+    free(times);
+    return 0;
+}
+
+/* Queue contention benchmark (--bench-queue): threads producers and threads consumers pass QUEUE_BENCH_ITEMS
+   items through a QUEUE_BENCH_CAPACITY slot queue, once through the lock-free mpmc_queue and once through the
+   mutex + condition variable queue it replaces.
+ */
+#define QUEUE_BENCH_ITEMS (1 << 20)
+#define QUEUE_BENCH_CAPACITY 1024
+#define QUEUE_BENCH_REPS 5
+
+struct locked_queue
+{
+    void **items;
+    int capacity, head, count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+static void locked_push(struct locked_queue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count++) % q->capacity] = item;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *locked_pop(struct locked_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    void *item = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+struct queue_bench_thread
+{
+    int lock_free;       // 1: mpmc_queue, 0: locked_queue
+    int producer;
+    long items;          // items this thread pushes or pops
+    struct mpmc_queue *mpmc;
+    struct locked_queue *locked;
+    unsigned long sum;   // consumers: sum of the items popped, to check nothing was lost
+};
 
+static void *queue_bench_threadfn(void *arg)
+{
+    struct queue_bench_thread *t = (struct queue_bench_thread *)arg;
+    for (long i = 1; i <= t->items; i++)
+    {
+        if (t->producer && t->lock_free)
+            mpmc_push(t->mpmc, (void *)i);
+        else if (t->producer)
+            locked_push(t->locked, (void *)i);
+        else
+            t->sum += (unsigned long)(t->lock_free ? mpmc_pop(t->mpmc) : locked_pop(t->locked));
+    }
     return NULL;
 }
 
-/*The driver of the program. Check for the correct number of arguments. If wrong print the message: "Usage ./a.out filename[s]"
-  It shall accept n filenames as arguments, separated by whitespace, e.g., ./a.out file1.ppm file2.ppm    file3.ppm
+/* Pass the items through one queue kind with threads producers and consumers. Return: seconds taken. */
+static double queue_bench_run(int lock_free, int threads)
+{
+    struct mpmc_queue mpmc;
+    struct locked_queue locked = {NULL, QUEUE_BENCH_CAPACITY, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                  PTHREAD_COND_INITIALIZER};
+    pthread_t ids[2 * threads];
+    struct queue_bench_thread args[2 * threads];
+    long per_thread = QUEUE_BENCH_ITEMS / threads;
+    if (mpmc_init(&mpmc, QUEUE_BENCH_CAPACITY) != 0 || !(locked.items = (void **)malloc(QUEUE_BENCH_CAPACITY * sizeof(void *))))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for benchmark\n");
+        exit(1);
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < 2 * threads; i++)
+    {
+        args[i] = (struct queue_bench_thread){lock_free, i < threads, per_thread, &mpmc, &locked, 0};
+        if (pthread_create(&ids[i], NULL, queue_bench_threadfn, &args[i]) != 0)
+        {
+            fprintf(stderr, "Error: Unable to create benchmark thread\n");
+            exit(1);
+        }
+    }
+    unsigned long sum = 0;
+    for (int i = 0; i < 2 * threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        sum += args[i].sum;
+    }
+    gettimeofday(&end, NULL);
+
+    if (sum != (unsigned long)threads * per_thread * (per_thread + 1) / 2)
+    {
+        fprintf(stderr, "Error: %s queue lost items\n", lock_free ? "lock-free" : "locked");
+        exit(1);
+    }
+    mpmc_destroy(&mpmc);
+    free(locked.items);
+    return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+int run_queue_bench(int threads)
+{
+    if (bench_affinity && set_bench_affinity(bench_affinity) != 0)
+        return 1;
+    printf("Queue benchmark: %d producers, %d consumers, %d slots, %d items, %d repetitions\n", threads, threads,
+           QUEUE_BENCH_CAPACITY, QUEUE_BENCH_ITEMS, QUEUE_BENCH_REPS);
+    printf("%-16s %10s %10s %10s\n", "queue", "min ms", "median ms", "Mops/s");
+    for (int lock_free = 1; lock_free >= 0; lock_free--)
+    {
+        double times[QUEUE_BENCH_REPS];
+        queue_bench_run(lock_free, threads); // warm-up
+        for (int r = 0; r < QUEUE_BENCH_REPS; r++)
+            times[r] = queue_bench_run(lock_free, threads);
+        qsort(times, QUEUE_BENCH_REPS, sizeof(double), compare_doubles);
+        long items = QUEUE_BENCH_ITEMS / threads * threads;
+        printf("%-16s %10.3f %10.3f %10.2f\n", lock_free ? "lock-free mpmc" : "mutex+condvar", times[0] * 1000,
+               times[QUEUE_BENCH_REPS / 2] * 1000, items / times[0] / 1e6);
+    }
+    return 0;
+}
+
+/* Print the command line usage and the available options. */
+void print_usage(void)
+{
+    printf("Usage: ./a.out [options] filename[s]\n");
+    printf("Options:\n");
+    printf("  --pipeline=SPEC   run a fused operator chain instead of the plain filter,\n");
+    printf("                    e.g. luma,blur:2,laplacian,threshold:40 (or @file to read SPEC from a file)\n");
+    printf("  --kernel=C,C,...  convolve with a custom 3x3, 5x5 or 7x7 integer kernel (row-major, or @file) instead of the laplacian\n");
+    printf("  --float-kernel=K  convolve in float with FMA: log:SIGMA, gauss-dx:SIGMA, gauss-dy:SIGMA or C,C,... coefficients\n");
+    printf("  --no-simd         use the scalar convolution loop\n");
+    printf("  --bench[=REPS]    time the integer and float kernel paths on each image instead of writing outputs (default 10 reps)\n");
+    printf("  --bench-affinity=CPU,...  pin the benchmark to these CPUs\n");
+    printf("  --bench-queue[=THREADS]  compare the lock-free queue with a mutex+condvar one, THREADS producers and consumers (default 4)\n");
+    printf("  --bench-interleave  run the benchmark variants round-robin instead of back to back\n");
+    printf("  --async           submit every image to the worker pool and collect the results off a lock-free completion queue\n");
+    printf("  --batch-small[=PIXELS]  filter images of up to PIXELS pixels (default 4096) that share their size 16 at a time\n");
+    printf("  --multi-image[=split|concat]  filter every image of multi-image PPM files, into laplacianN_K.ppm or all into laplacianN.ppm\n");
+    printf("  --roi=X,Y,W,H     only filter (and write) the W x H window at X,Y of each image, treating it as an image of its own\n");
+    printf("  --mmap-output[=POLICY]  filter straight into the mmapped output file; POLICY is none (default), async or sync\n");
+    printf("                    msync per band, plus \",dontneed\" to drop each band from memory once it is done\n");
+    printf("  --manifest=FILE   append output path, size, checksums (whole image and per band) and timing to FILE\n");
+    printf("  --mem-pressure[=AVG10[:USAGE]]  admit fewer images at once while memory PSI some avg10 >= AVG10%% (default 10)\n");
+    printf("                    or cgroup memory usage >= USAGE of its limit (default 0.9)\n");
+    printf("  --adaptive-tiles[=MIN:MAX]  tune the rows per tile while running, between MIN and MAX (default 8:4096)\n");
+    printf("  --elastic         size the worker pool to the cgroup CPU quota and park workers while it is throttled\n");
+    printf("  --read-limit=MB/s, --write-limit=MB/s  cap the read and write bandwidth (token bucket)\n");
+    printf("  --daemon=SOCKET   serve FILTER/RATE/STATS requests on a Unix socket instead of filtering the arguments\n");
+    printf("  --cache=MB        daemon result cache size (default 256, 0 turns it off)\n");
+    printf("  --triage[=TILES]  only estimate the edge density of each image from TILES sampled tiles (default 32)\n");
+    printf("  --hough[=K]       also vote for Hough lines with the edge pixels while filtering and print the K strongest (default 10)\n");
+    printf("  --bayer=PATTERN:WxH[:BITS]  the inputs are raw rggb/bggr/grbg/gbrg frames (BITS > 8: 16-bit little-endian), demosaiced as they are filtered\n");
+    printf("  --mask=FILE       only filter the 32x32 tiles touching the PBM/PGM mask FILE (same size as the images)\n");
+    printf("  --mask-outside=zero|keep  outside the mask the result is black (default) or keeps an existing laplacianN.ppm\n");
+    printf("  --yuv=FORMAT:WxH  the inputs are raw i420 or nv12 frames of W x H: filter each Y plane into laplacianN.pgm (P5 frames)\n");
+    printf("  --diff[=FRACTION] take the files as before/after pairs and write |L(a) - L(b)| (diffN.ppm) and a map of the\n");
+    printf("                    %dx%d tiles where at least FRACTION of the pixels changed (changeN.pgm, default 0.02)\n", DIFF_TILE, DIFF_TILE);
+    printf("  --components[=MIN_AREA]  label the connected edge components of each image and list those of at least MIN_AREA pixels (default 64)\n");
+    printf("  --edge-threshold=N  laplacian response that counts as an edge (0 to 255, default 64)\n");
+}
+
+/* Build with -DLAPLACIAN_LIBRARY to embed the filter (apply_filters, apply_filters_async, ...) in another program. */
+#ifndef LAPLACIAN_LIBRARY
+/* What a run does, picked by the options in the order main dispatches them. --batch-small and --multi-image are
+   variants of the default mode (a thread per file) but don't take all of its options.
+ */
+enum run_mode
+{
+    MODE_DEFAULT,
+    MODE_MULTI_IMAGE,
+    MODE_BATCH_SMALL,
+    MODE_ASYNC,
+    MODE_MASK,
+    MODE_YUV,
+    MODE_DIFF,
+    MODE_COMPONENTS,
+    MODE_TRIAGE,
+    MODE_BENCH,
+    MODE_BENCH_QUEUE,
+    MODE_DAEMON,
+    MODE_COUNT
+};
+
+static const char *mode_names[MODE_COUNT] = {"the default mode (a thread per file)", "--multi-image", "--batch-small",
+                                             "--async", "--mask", "--yuv", "--diff", "--components", "--triage",
+                                             "--bench", "--bench-queue", "--daemon"};
+
+#define IN(mode) (1u << (mode))
+#define ALL_MODES (IN(MODE_COUNT) - 1)
+#define FILTER_MODES (ALL_MODES & ~IN(MODE_BENCH_QUEUE))
+#define POOL_MODES (IN(MODE_DEFAULT) | IN(MODE_MULTI_IMAGE) | IN(MODE_BATCH_SMALL) | IN(MODE_ASYNC) | IN(MODE_YUV) | \
+                    IN(MODE_BENCH) | IN(MODE_DAEMON)) // the ones that filter through the worker pool
+
+/* The modes each option works in. An option that would be ignored by the mode of the run is an error instead. */
+static const struct
+{
+    const char *name;
+    unsigned modes;
+} option_modes[] = {
+    {"--pipeline", IN(MODE_DEFAULT) | IN(MODE_MULTI_IMAGE) | IN(MODE_ASYNC) | IN(MODE_DAEMON)},
+    {"--kernel", FILTER_MODES},
+    {"--float-kernel", FILTER_MODES & ~IN(MODE_BATCH_SMALL)},
+    {"--no-simd", FILTER_MODES & ~IN(MODE_BENCH)}, // the benchmark picks the row functions itself
+    {"--bench", IN(MODE_BENCH)},
+    {"--bench-affinity", IN(MODE_BENCH) | IN(MODE_BENCH_QUEUE)},
+    {"--bench-queue", IN(MODE_BENCH_QUEUE)},
+    {"--bench-interleave", IN(MODE_BENCH)},
+    {"--async", IN(MODE_ASYNC)},
+    {"--roi", IN(MODE_DEFAULT) | IN(MODE_MULTI_IMAGE)},
+    {"--batch-small", IN(MODE_BATCH_SMALL)},
+    {"--multi-image", IN(MODE_MULTI_IMAGE)},
+    {"--mmap-output", IN(MODE_DEFAULT) | IN(MODE_ASYNC)},
+    {"--manifest", IN(MODE_DEFAULT) | IN(MODE_MULTI_IMAGE) | IN(MODE_BATCH_SMALL) | IN(MODE_ASYNC) | IN(MODE_DAEMON)},
+    {"--mem-pressure", IN(MODE_DEFAULT) | IN(MODE_MULTI_IMAGE) | IN(MODE_BATCH_SMALL)},
+    {"--adaptive-tiles", POOL_MODES},
+    {"--elastic", POOL_MODES},
+    {"--read-limit", FILTER_MODES},
+    {"--write-limit", FILTER_MODES & ~(IN(MODE_BENCH) | IN(MODE_TRIAGE) | IN(MODE_COMPONENTS))},
+    {"--daemon", IN(MODE_DAEMON)},
+    {"--cache", IN(MODE_DAEMON)},
+    {"--triage", IN(MODE_TRIAGE)},
+    {"--hough", IN(MODE_DEFAULT)},
+    {"--bayer", IN(MODE_DEFAULT)},
+    {"--mask", IN(MODE_MASK)},
+    {"--mask-outside", IN(MODE_MASK)},
+    {"--yuv", IN(MODE_YUV)},
+    {"--diff", IN(MODE_DIFF)},
+    {"--components", IN(MODE_COMPONENTS)},
+    {"--edge-threshold", IN(MODE_DEFAULT) | IN(MODE_COMPONENTS) | IN(MODE_TRIAGE) | IN(MODE_DIFF)}, // --hough uses it too
+};
+
+/* Return: 1 if option (e.g. "--roi=0,0,64,64") works in mode, 0 if the mode would ignore it. */
+static int option_works_in(const char *option, enum run_mode mode)
+{
+    size_t length = strcspn(option, "=");
+    for (size_t i = 0; i < sizeof(option_modes) / sizeof(option_modes[0]); i++)
+    {
+        if (strlen(option_modes[i].name) == length && strncmp(option, option_modes[i].name, length) == 0)
+            return (option_modes[i].modes & IN(mode)) != 0;
+    }
+    return 1; // "--"
+}
+
+/* Parse the number of an option such as --bench=N (text points at N) into *value.
+   Return: 0, or -1 (after printing why) if it isn't an integer from min to max.
+ */
+static int parse_int_option(const char *option, const char *text, int min, int max, int *value)
+{
+    char *end;
+    long number = strtol(text, &end, 10); // saturates, so out of range stays out of range
+    if (end == text || *end != '\0' || number < min || number > max)
+    {
+        int length = (int)strcspn(option, "=");
+        if (max == INT_MAX)
+            fprintf(stderr, "Error: %.*s needs an integer of at least %d, not '%s'\n", length, option, min, text);
+        else
+            fprintf(stderr, "Error: %.*s needs an integer from %d to %d, not '%s'\n", length, option, min, max, text);
+        return -1;
+    }
+    *value = (int)number;
+    return 0;
+}
+
+/*The driver of the program. Check for the correct number of arguments. If wrong print the usage message.
+  It shall accept options (starting with --) followed by n filenames, separated by whitespace, e.g., ./a.out file1.ppm file2.ppm    file3.ppm
   It will create a thread for each input file to manage.
   It will print the total elapsed time in .4 precision seconds(e.g., 0.1234 s).
  */
 int main(int argc, char *argv[])
 {
-    if (argc < 2)
+    int triage = 0, components = 0, diff = 0, async = 0, mem_pressure = 0, elastic = 0, bench_reps = 0, bench_queue = 0;
+    const char *daemon_socket = NULL;
+    int first_file = 1;
+    for (; first_file < argc && strncmp(argv[first_file], "--", 2) == 0; first_file++)
+    {
+        const char *opt = argv[first_file];
+        if (strcmp(opt, "--") == 0)
+        {
+            first_file++;
+            break;
+        }
+        else if (strncmp(opt, "--pipeline=", 11) == 0)
+        {
+            if (parse_pipeline(opt + 11, &filter_pipeline_spec) != 0)
+                return 1;
+            filter_pipeline = &filter_pipeline_spec;
+        }
+        else if (strncmp(opt, "--kernel=", 9) == 0)
+        {
+            if (parse_kernel(opt + 9, &filter_kernel_spec) != 0)
+                return 1;
+            filter_kernel = &filter_kernel_spec;
+        }
+        else if (strncmp(opt, "--float-kernel=", 15) == 0)
+        {
+            if (parse_float_kernel(opt + 15, &filter_float_kernel_spec) != 0)
+                return 1;
+            filter_float_kernel = &filter_float_kernel_spec;
+        }
+        else if (strcmp(opt, "--bench") == 0 || strncmp(opt, "--bench=", 8) == 0)
+        {
+            bench_reps = 10;
+            if (opt[7] == '=' && parse_int_option(opt, opt + 8, 1, INT_MAX, &bench_reps) != 0)
+                return 1;
+        }
+        else if (strncmp(opt, "--bench-affinity=", 17) == 0)
+        {
+            bench_affinity = opt + 17;
+        }
+        else if (strcmp(opt, "--bench-queue") == 0 || strncmp(opt, "--bench-queue=", 14) == 0)
+        {
+            bench_queue = 4;
+            if (opt[13] == '=' && parse_int_option(opt, opt + 14, 1, INT_MAX, &bench_queue) != 0)
+                return 1;
+        }
+        else if (strcmp(opt, "--bench-interleave") == 0)
+        {
+            bench_interleave = 1;
+        }
+        else if (strcmp(opt, "--no-simd") == 0)
+        {
+            simd_enabled = 0;
+        }
+        else if (strcmp(opt, "--async") == 0)
+        {
+            async = 1;
+        }
+        else if (strncmp(opt, "--roi=", 6) == 0)
+        {
+            roi.enabled = 1;
+            if (sscanf(opt + 6, "%lu,%lu,%lu,%lu", &roi.x, &roi.y, &roi.w, &roi.h) != 4 || roi.w == 0 || roi.h == 0)
+            {
+                fprintf(stderr, "Error: --roi needs X,Y,W,H with a non-empty size\n");
+                return 1;
+            }
+        }
+        else if (strcmp(opt, "--batch-small") == 0 || strncmp(opt, "--batch-small=", 14) == 0)
+        {
+            batch_small_pixels = opt[13] == '=' ? strtoul(opt + 14, NULL, 10) : 64 * 64;
+            if (batch_small_pixels == 0)
+            {
+                fprintf(stderr, "Error: --batch-small needs a pixel count\n");
+                return 1;
+            }
+        }
+        else if (strcmp(opt, "--multi-image") == 0 || strncmp(opt, "--multi-image=", 14) == 0)
+        {
+            multi_image.enabled = 1;
+            if (opt[13] == '=' && strcmp(opt + 14, "concat") == 0)
+                multi_image.concat = 1;
+            else if (opt[13] == '=' && strcmp(opt + 14, "split") != 0)
+            {
+                fprintf(stderr, "Error: --multi-image takes split or concat\n");
+                return 1;
+            }
+        }
+        else if (strcmp(opt, "--mmap-output") == 0 || strncmp(opt, "--mmap-output=", 14) == 0)
+        {
+            mmap_output.enabled = 1;
+            if (opt[13] == '=' && parse_mmap_policy(opt + 14) != 0)
+                return 1;
+        }
+        else if (strncmp(opt, "--manifest=", 11) == 0)
+        {
+            manifest_file = fopen(opt + 11, "a");
+            if (!manifest_file)
+            {
+                fprintf(stderr, "Error: Unable to open manifest %s\n", opt + 11);
+                return 1;
+            }
+        }
+        else if (strcmp(opt, "--mem-pressure") == 0 || strncmp(opt, "--mem-pressure=", 15) == 0)
+        {
+            mem_pressure = 1;
+            if (opt[14] == '=')
+                sscanf(opt + 15, "%lf:%lf", &pressure.avg10_threshold, &pressure.usage_threshold);
+        }
+        else if (strcmp(opt, "--adaptive-tiles") == 0 || strncmp(opt, "--adaptive-tiles=", 17) == 0)
+        {
+            tiling.enabled = 1;
+            if (opt[16] == '=' && (sscanf(opt + 17, "%d:%d", &tiling.min_rows, &tiling.max_rows) != 2 ||
+                                   tiling.min_rows < 1 || tiling.max_rows < tiling.min_rows))
+            {
+                fprintf(stderr, "Error: --adaptive-tiles needs MIN:MAX rows with 1 <= MIN <= MAX\n");
+                return 1;
+            }
+            if (tiling.rows < tiling.min_rows)
+                tiling.rows = tiling.min_rows;
+            if (tiling.rows > tiling.max_rows)
+                tiling.rows = tiling.max_rows;
+        }
+        else if (strcmp(opt, "--elastic") == 0)
+        {
+            elastic = 1;
+        }
+        else if (strncmp(opt, "--read-limit=", 13) == 0)
+        {
+            rate_limit_set(&read_limit, atof(opt + 13) * 1e6);
+        }
+        else if (strncmp(opt, "--write-limit=", 14) == 0)
+        {
+            rate_limit_set(&write_limit, atof(opt + 14) * 1e6);
+        }
+        else if (strncmp(opt, "--daemon=", 9) == 0)
+        {
+            daemon_socket = opt + 9;
+        }
+        else if (strncmp(opt, "--cache=", 8) == 0)
+        {
+            result_cache.limit = (size_t)(atof(opt + 8) * (1 << 20));
+        }
+        else if (strcmp(opt, "--triage") == 0 || strncmp(opt, "--triage=", 9) == 0)
+        {
+            triage = 1;
+            if (opt[8] == '=' && parse_int_option(opt, opt + 9, 1, INT_MAX, &triage_tiles) != 0)
+                return 1;
+        }
+        else if (strcmp(opt, "--hough") == 0 || strncmp(opt, "--hough=", 8) == 0)
+        {
+            hough_top_k = opt[7] == '=' ? atoi(opt + 8) : 10;
+            if (hough_top_k < 1)
+            {
+                fprintf(stderr, "Error: --hough needs at least one line\n");
+                return 1;
+            }
+        }
+        else if (strncmp(opt, "--bayer=", 8) == 0)
+        {
+            if (parse_bayer_spec(opt + 8) != 0)
+                return 1;
+        }
+        else if (strncmp(opt, "--mask=", 7) == 0)
+        {
+            mask_file_name = opt + 7;
+        }
+        else if (strncmp(opt, "--mask-outside=", 15) == 0)
+        {
+            if (strcmp(opt + 15, "keep") == 0)
+                mask_keep_outside = 1;
+            else if (strcmp(opt + 15, "zero") != 0)
+            {
+                fprintf(stderr, "Error: --mask-outside takes zero or keep\n");
+                return 1;
+            }
+        }
+        else if (strncmp(opt, "--yuv=", 6) == 0)
+        {
+            if (parse_yuv_spec(opt + 6) != 0)
+                return 1;
+        }
+        else if (strcmp(opt, "--diff") == 0 || strncmp(opt, "--diff=", 7) == 0)
+        {
+            diff = 1;
+            if (opt[6] == '=')
+                change_fraction = atof(opt + 7);
+        }
+        else if (strcmp(opt, "--components") == 0 || strncmp(opt, "--components=", 13) == 0)
+        {
+            components = 1;
+            if (opt[12] == '=' && parse_int_option(opt, opt + 13, 1, INT_MAX, &component_min_area) != 0)
+                return 1;
+        }
+        else if (strncmp(opt, "--edge-threshold=", 17) == 0)
+        {
+            if (parse_int_option(opt, opt + 17, 0, 255, &edge_threshold) != 0)
+                return 1;
+        }
+        else
+        {
+            fprintf(stderr, "Error: Unknown option %s\n", opt);
+            print_usage();
+            return 1;
+        }
+    }
+
+    enum run_mode mode = daemon_socket         ? MODE_DAEMON
+                         : bench_queue         ? MODE_BENCH_QUEUE
+                         : bench_reps          ? MODE_BENCH
+                         : triage              ? MODE_TRIAGE
+                         : components          ? MODE_COMPONENTS
+                         : diff                ? MODE_DIFF
+                         : yuv_input.enabled   ? MODE_YUV
+                         : mask_file_name      ? MODE_MASK
+                         : async               ? MODE_ASYNC
+                         : batch_small_pixels  ? MODE_BATCH_SMALL
+                         : multi_image.enabled ? MODE_MULTI_IMAGE
+                                               : MODE_DEFAULT;
+    for (int i = 1; i < first_file; i++)
+    {
+        if (!option_works_in(argv[i], mode))
+        {
+            fprintf(stderr, "Error: %.*s doesn't work with %s\n", (int)strcspn(argv[i], "="), argv[i], mode_names[mode]);
+            return 1;
+        }
+    }
+    if (elastic)
+        start_cpu_quota_monitor();
+    if (daemon_socket)
+        return run_daemon(daemon_socket);
+    if (bench_queue)
+        return run_queue_bench(bench_queue);
+
+    if (first_file >= argc)
     {
-        printf("Usage: ./a.out filename[s]\n");
+        print_usage();
         return 1;
     }
-    pthread_mutex_init(&time_mutex, NULL); // initialize mutex
+    if (bench_reps)
+        return run_bench(argv + first_file, argc - first_file, bench_reps);
+    if (triage)
+        return run_triage(argv + first_file, argc - first_file);
+    if (components)
+        return run_components(argv + first_file, argc - first_file);
+    if (diff)
+        return run_diff(argv + first_file, argc - first_file);
+    if (yuv_input.enabled)
+        return run_yuv(argv + first_file, argc - first_file);
+    if (mask_file_name)
+        return run_masked(argv + first_file, argc - first_file);
+    if (async)
+        return run_async(argv + first_file, argc - first_file);
 
-    pthread_t threads[argc - 1];
+    int file_count = argc - first_file;
+    pthread_t threads[file_count];
+    char batched[file_count];
+    memset(batched, 0, sizeof(batched));
+    if (batch_small_pixels && filter_small_images(argv + first_file, file_count, batched) != 0)
+        return 1;
+    if (mem_pressure)
+        start_pressure_monitor(file_count);
 
     // create each thread
-    for (int i = 1; i < argc; i++)
+    for (int i = 0; i < file_count; i++)
     {
+        if (batched[i])
+            continue;
         pthread_mutex_lock(&time_mutex);
         struct file_name_args *args = (struct file_name_args *)malloc(sizeof(struct file_name_args));
         if (!args)
@@ -347,12 +6209,12 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Error: Unable to allocate memory for file arguments.\n");
             return 1;
         }
-        args->input_file_name = argv[i];
-        sprintf(args->output_file_name, "laplacian%d.ppm", i);
+        args->input_file_name = argv[first_file + i];
+        sprintf(args->output_file_name, "laplacian%d.ppm", i + 1);
 
-        if (pthread_create(&threads[i - 1], NULL, manage_image_file, args) != 0)
+        if (pthread_create(&threads[i], NULL, manage_image_file, args) != 0)
         {
-            fprintf(stderr, "Error: Unable to create thread for file %s.\n", argv[i]);
+            fprintf(stderr, "Error: Unable to create thread for file %s.\n", argv[first_file + i]);
             free(args);
             return 1;
         }
@@ -360,12 +6222,16 @@ int main(int argc, char *argv[])
     }
 
     // wait for threads to finish
-    for (int i = 0; i < argc - 1; i++)
+    for (int i = 0; i < file_count; i++)
     {
-        pthread_join(threads[i], NULL);
+        if (!batched[i])
+            pthread_join(threads[i], NULL);
     }
 
+    if (mem_pressure)
+        stop_pressure_monitor();
     pthread_mutex_destroy(&time_mutex); // destroy mutex
     printf("Total elapsed time: %.4f s\n", total_elapsed_time);
     return 0;
 }
+#endif // LAPLACIAN_LIBRARY
@@ -24,5 +24,5 @@ if [ ${#files[@]} -eq 0 ]; then
     exit 1
 fi
 
-gcc -o edge_detector edge_detector.c
+gcc -o edge_detector edge_detector.c -lm
 ./edge_detector "${files[@]}"
\ No newline at end of file